@@ -0,0 +1,345 @@
+/*
+Mock implementation of the parts of the ALPAO SDK used by runALPAO,
+resetALPAO and releaseALPAO, for running and benchmarking without a DM on
+the PCIe bus.
+
+To compile (in place of -lasdk):
+>>>gcc runALPAO.c asdkMock.c -o build/runALPAO_mock -lImageStreamIO -lpthread -lrt -lcfitsio -lm
+or
+>>>make runALPAO_mock
+
+The mock is configured through environment variables, since asdkInit()
+only receives the serial number:
+
+ALPAO_MOCK_NBACT    number of actuators reported by asdkGet("NbOfActuator")
+                    (default 97)
+ALPAO_MOCK_LATENCY  time asdkSend() takes, in microseconds, as one of
+                    fixed:<us>
+                    uniform:<min_us>:<max_us>
+                    normal:<mean_us>:<sigma_us>
+                    (default: return immediately)
+ALPAO_MOCK_RECORD   file to record every vector sent to the mirror. Each
+                    record is a uint64 frame number, a uint64 CLOCK_REALTIME
+                    timestamp in ns and nbAct doubles.
+
+asdkSend() busy-waits for the drawn latency, like the real driver blocking
+on the transfer, so the control loop sees realistic timing.
+
+The mock also stands in for malloc() and friends, passing them on to
+glibc and counting the allocations each thread makes. runALPAO reads the
+count through asdkMockHeapAllocs() to show that its loop doesn't touch
+the heap.
+*/
+
+/* System Headers */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+
+/* Alpao SDK C Header */
+#include "asdkWrapper.h"
+
+#define MOCK_DEFAULT_NBACT 97
+
+enum { LATENCY_NONE, LATENCY_FIXED, LATENCY_UNIFORM, LATENCY_NORMAL };
+
+struct DM
+{
+    char serial[128];
+    int nbAct;
+    int latency_type;
+    double latency_a;  // fixed value, minimum or mean (us)
+    double latency_b;  // maximum or sigma (us)
+    unsigned int seed;
+    FILE * record;
+    uint64_t nsent;
+};
+
+static char last_error[256] = "";
+
+static void set_error(const char * msg, const char * detail)
+{
+    snprintf(last_error, sizeof(last_error), "asdkMock: %s%s", msg, detail ? detail : "");
+}
+
+/* Parse ALPAO_MOCK_LATENCY; returns -1 if it is set but malformed */
+static int parse_latency(asdkDM * dm, const char * spec)
+{
+    dm->latency_type = LATENCY_NONE;
+    if (spec == NULL || spec[0] == '\0')
+    {
+        return 0;
+    }
+    if (sscanf(spec, "fixed:%lf", &dm->latency_a) == 1)
+    {
+        dm->latency_type = LATENCY_FIXED;
+    } else if (sscanf(spec, "uniform:%lf:%lf", &dm->latency_a, &dm->latency_b) == 2)
+    {
+        dm->latency_type = LATENCY_UNIFORM;
+    } else if (sscanf(spec, "normal:%lf:%lf", &dm->latency_a, &dm->latency_b) == 2)
+    {
+        dm->latency_type = LATENCY_NORMAL;
+    } else
+    {
+        set_error("could not parse ALPAO_MOCK_LATENCY=", spec);
+        return -1;
+    }
+    return 0;
+}
+
+/* Draw one send latency in nanoseconds */
+static int64_t draw_latency(asdkDM * dm)
+{
+    double us = 0;
+    double u1, u2;
+
+    switch (dm->latency_type)
+    {
+    case LATENCY_FIXED:
+        us = dm->latency_a;
+        break;
+    case LATENCY_UNIFORM:
+        us = dm->latency_a + (dm->latency_b - dm->latency_a) * rand_r(&dm->seed) / (double) RAND_MAX;
+        break;
+    case LATENCY_NORMAL:
+        // Box-Muller
+        u1 = (rand_r(&dm->seed) + 1.0) / ((double) RAND_MAX + 2.0);
+        u2 = rand_r(&dm->seed) / (double) RAND_MAX;
+        us = dm->latency_a + dm->latency_b * sqrt(-2 * log(u1)) * cos(2 * M_PI * u2);
+        break;
+    default:
+        break;
+    }
+    return us > 0 ? (int64_t)(us * 1e3) : 0;
+}
+
+static int64_t now_ns(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void record_vector(asdkDM * dm, const Scalar * value)
+{
+    uint64_t header[2];
+
+    if (dm->record == NULL)
+    {
+        return;
+    }
+    header[0] = dm->nsent;
+    header[1] = (uint64_t) now_ns(CLOCK_REALTIME);
+    fwrite(header, sizeof(uint64_t), 2, dm->record);
+    fwrite(value, sizeof(Scalar), dm->nbAct, dm->record);
+}
+
+asdkDM * asdkInit(const Char * serialName)
+{
+    asdkDM * dm;
+    const char * env;
+
+    dm = (asdkDM *) calloc(1, sizeof(asdkDM));
+    if (dm == NULL)
+    {
+        set_error("out of memory", NULL);
+        return NULL;
+    }
+    strncpy(dm->serial, serialName, sizeof(dm->serial) - 1);
+    dm->seed = 1;
+
+    env = getenv("ALPAO_MOCK_NBACT");
+    dm->nbAct = env ? atoi(env) : MOCK_DEFAULT_NBACT;
+    if (dm->nbAct <= 0)
+    {
+        set_error("invalid ALPAO_MOCK_NBACT=", env);
+        free(dm);
+        return NULL;
+    }
+
+    if (parse_latency(dm, getenv("ALPAO_MOCK_LATENCY")) == -1)
+    {
+        free(dm);
+        return NULL;
+    }
+
+    env = getenv("ALPAO_MOCK_RECORD");
+    if (env != NULL && env[0] != '\0')
+    {
+        dm->record = fopen(env, "wb");
+        if (dm->record == NULL)
+        {
+            set_error("could not open ALPAO_MOCK_RECORD=", env);
+            free(dm);
+            return NULL;
+        }
+    }
+
+    printf("asdkMock %s: %d actuators, latency %s\n", dm->serial, dm->nbAct,
+           getenv("ALPAO_MOCK_LATENCY") ? getenv("ALPAO_MOCK_LATENCY") : "none");
+    return dm;
+}
+
+COMPL_STAT asdkGet(asdkDM * pDm, const Char * command, Scalar * value)
+{
+    if (pDm == NULL)
+    {
+        set_error("asdkGet on a released DM", NULL);
+        return FAILURE;
+    }
+    if (strcmp(command, "NbOfActuator") == 0)
+    {
+        *value = pDm->nbAct;
+        return SUCCESS;
+    }
+    set_error("unsupported asdkGet command ", command);
+    return FAILURE;
+}
+
+COMPL_STAT asdkSend(asdkDM * pDm, const Scalar * value)
+{
+    int64_t until;
+
+    if (pDm == NULL)
+    {
+        set_error("asdkSend on a released DM", NULL);
+        return FAILURE;
+    }
+
+    // busy-wait like the driver blocking on the transfer
+    until = now_ns(CLOCK_MONOTONIC) + draw_latency(pDm);
+    while (now_ns(CLOCK_MONOTONIC) < until)
+    {
+    }
+
+    record_vector(pDm, value);
+    pDm->nsent++;
+    return SUCCESS;
+}
+
+COMPL_STAT asdkReset(asdkDM * pDm)
+{
+    Scalar * zeros;
+    COMPL_STAT ret;
+
+    if (pDm == NULL)
+    {
+        set_error("asdkReset on a released DM", NULL);
+        return FAILURE;
+    }
+    zeros = (Scalar *) calloc(pDm->nbAct, sizeof(Scalar));
+    if (zeros == NULL)
+    {
+        set_error("out of memory", NULL);
+        return FAILURE;
+    }
+    ret = asdkSend(pDm, zeros);
+    free(zeros);
+    return ret;
+}
+
+COMPL_STAT asdkRelease(asdkDM * pDm)
+{
+    if (pDm == NULL)
+    {
+        set_error("asdkRelease on a released DM", NULL);
+        return FAILURE;
+    }
+    printf("asdkMock %s: %llu vectors sent\n", pDm->serial, (unsigned long long) pDm->nsent);
+    if (pDm->record != NULL)
+    {
+        fclose(pDm->record);
+    }
+    free(pDm);
+    return SUCCESS;
+}
+
+void asdkPrintLastError()
+{
+    if (last_error[0] != '\0')
+    {
+        printf("%s\n", last_error);
+        last_error[0] = '\0';
+    }
+}
+
+/* Allocation counting. glibc's own entry points do the work; every call
+that hands out memory counts against the calling thread. */
+extern void * __libc_malloc(size_t size);
+extern void * __libc_calloc(size_t nmemb, size_t size);
+extern void * __libc_realloc(void * ptr, size_t size);
+extern void * __libc_memalign(size_t alignment, size_t size);
+extern void * __libc_valloc(size_t size);
+extern void * __libc_pvalloc(size_t size);
+
+static __thread unsigned long heap_allocs;
+
+// allocations made so far by the calling thread
+unsigned long asdkMockHeapAllocs(void)
+{
+    return heap_allocs;
+}
+
+void * malloc(size_t size)
+{
+    heap_allocs++;
+    return __libc_malloc(size);
+}
+
+void * calloc(size_t nmemb, size_t size)
+{
+    heap_allocs++;
+    return __libc_calloc(nmemb, size);
+}
+
+void * realloc(void * ptr, size_t size)
+{
+    heap_allocs++;
+    return __libc_realloc(ptr, size);
+}
+
+void * memalign(size_t alignment, size_t size)
+{
+    heap_allocs++;
+    return __libc_memalign(alignment, size);
+}
+
+void * aligned_alloc(size_t alignment, size_t size)
+{
+    heap_allocs++;
+    return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void ** memptr, size_t alignment, size_t size)
+{
+    void * ptr;
+
+    if (alignment < sizeof(void *) || (alignment & (alignment - 1)) != 0)
+    {
+        return EINVAL;
+    }
+    heap_allocs++;
+    ptr = __libc_memalign(alignment, size);
+    if (ptr == NULL)
+    {
+        return ENOMEM;
+    }
+    *memptr = ptr;
+    return 0;
+}
+
+void * valloc(size_t size)
+{
+    heap_allocs++;
+    return __libc_valloc(size);
+}
+
+void * pvalloc(size_t size)
+{
+    heap_allocs++;
+    return __libc_pvalloc(size);
+}
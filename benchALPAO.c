@@ -0,0 +1,618 @@
+/*
+To compile:
+>>>gcc benchALPAO.c -o build/benchALPAO -lImageStreamIO -lpthread -lrt -lcfitsio -lm
+or
+>>>make benchALPAO
+
+Usage:
+To benchmark the mock-backed control loop with defaults (97 actuators,
+default flags, frames posted as fast as possible)
+>>>./benchALPAO
+To sweep actuator counts and every flag combination at 2 kHz with a
+simulated 20-40 us DM transfer, writing CSV to a file
+>>>./benchALPAO --nbact=97,277 --flags=all --rate=2000 --latency=uniform:20:40 --output=bench.csv
+
+For help:
+>>>./benchALPAO --help
+
+What it does:
+For each actuator count, writes a calibration and a roughly circular
+actuator map on a grid just big enough for it to a temporary ALPAO_CALIB
+directory and creates the shared memory image of the same size. Then for
+each flag combination it starts runALPAO (built against the mock
+DM, see asdkMock.c) on that image, posts frames at a fixed rate or as
+fast as possible, and stops the loop with SIGINT. The achieved update
+rate and dropped-frame count come from the vectors the mock DM records
+(ALPAO_MOCK_RECORD), and the write-to-send latency percentiles from
+runALPAO's built-in histograms. One CSV line per configuration is
+written to stdout (or --output); progress goes to stderr.
+*/
+
+#define _GNU_SOURCE // qsort_r
+
+/* System Headers */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <signal.h>
+#include <argp.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <dirent.h>
+
+/* cacao */
+#include "ImageStruct.h"   // cacao data structure definition
+#include "ImageStreamIO.h" // function ImageStreamIO_read_sharedmem_image_toIMAGE()
+
+/* FITS */
+#include "fitsio.h"
+
+#define MAX_STRLEN 1000
+#define BENCH_SERIAL "BENCH"
+#define MAX_CONFIGS 64
+
+/* Summary of one runALPAO run */
+typedef struct
+{
+    unsigned long sent;     // commands runALPAO reports, including the initial all-zero one
+    double p50, p99, p999, max; // write -> sent latency (us), from runALPAO's report
+    unsigned long nlatency; // frames with a write time
+    long handled;           // frame commands the mock DM received
+    double achieved_hz;     // rate at which they arrived
+} runResult;
+
+/* Side of the square grid for nbAct actuators: a disc of nbAct pixels
+just fits, as on the ALPAO models (runALPAO sizes its image from the map) */
+int grid_dim(int nbAct)
+{
+    int dim = (int) ceil(sqrt(4 * nbAct / M_PI));
+
+    while (dim * dim < nbAct)
+    {
+        dim++;
+    }
+    return dim;
+}
+
+/* Write the userconfig and a roughly circular actuator map with nbAct
+actuators, nearest the centre of the dim x dim grid first, so the
+gather pattern looks like a real ALPAO map */
+static int compare_distance(const void * a, const void * b, void * dist)
+{
+    const int * d = (const int *) dist;
+
+    return d[*(const int *)a] - d[*(const int *)b];
+}
+
+int write_calibration(const char * calibdir, int nbAct, int dim)
+{
+    char path[MAX_STRLEN];
+    FILE * fp;
+    fitsfile * fptr;
+    int status = 0;
+    long naxes[2] = {dim, dim};
+    int * dist;
+    int * order;
+    int * pix;
+    int i, x, y;
+
+    snprintf(path, MAX_STRLEN, "%s/%s_userconfig.txt", calibdir, "bench");
+    fp = fopen(path, "w");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "benchALPAO: could not write %s\n", path);
+        return -1;
+    }
+    fprintf(fp, "3.17 #maxstroke in microns\n0.43 #volume conversion factor\n");
+    fclose(fp);
+
+    dist = (int *) malloc(dim * dim * sizeof(int));
+    order = (int *) malloc(dim * dim * sizeof(int));
+    pix = (int *) malloc(dim * dim * sizeof(int));
+    if (dist == NULL || order == NULL || pix == NULL)
+    {
+        fprintf(stderr, "benchALPAO: out of memory\n");
+        free(dist);
+        free(order);
+        free(pix);
+        return -1;
+    }
+    for ( i = 0 ; i < dim * dim ; i++ )
+    {
+        x = 2 * (i % dim) - (dim - 1);
+        y = 2 * (i / dim) - (dim - 1);
+        dist[i] = x * x + y * y;
+        order[i] = i;
+        pix[i] = 0;
+    }
+    qsort_r(order, dim * dim, sizeof(int), compare_distance, dist);
+    for ( i = 0 ; i < nbAct ; i++ )
+    {
+        pix[order[i]] = 1;
+    }
+
+    // leading ! tells CFITSIO to overwrite
+    snprintf(path, MAX_STRLEN, "!%s/%s_actuator_mapping.fits", calibdir, "bench");
+    fits_create_file(&fptr, path, &status);
+    fits_create_img(fptr, LONG_IMG, 2, naxes, &status);
+    fits_write_img(fptr, TINT, 1, dim * dim, pix, &status);
+    fits_close_file(fptr, &status);
+    free(dist);
+    free(order);
+    free(pix);
+    if (status)
+    {
+        fits_report_error(stderr, status);
+        return -1;
+    }
+    return 0;
+}
+
+// Create the input image the way runALPAO expects it, the size of the actuator map
+IMAGE * create_stream(const char * shm_name, int dim)
+{
+    uint32_t imsize[2] = {dim, dim};
+    IMAGE * SMimage;
+
+    SMimage = (IMAGE*) malloc(sizeof(IMAGE));
+    ImageStreamIO_createIm(&SMimage[0], shm_name, 2, imsize, _DATATYPE_FLOAT, 1, 10, 10);
+    memset(SMimage[0].array.F, 0, (size_t) dim * dim * sizeof(float));
+    return SMimage;
+}
+
+// Write one frame of small random values and post it
+void post_frame(IMAGE * SMimage, unsigned int * seed)
+{
+    int i;
+
+    SMimage[0].md[0].write = 1;
+    for ( i = 0 ; i < (int) SMimage[0].md[0].nelement ; i++ )
+    {
+        // +-0.5 um: exercises the conversion without saturating
+        SMimage[0].array.F[i] = (float) rand_r(seed) / RAND_MAX - 0.5f;
+    }
+    SMimage[0].md[0].write = 0;
+    SMimage[0].md[0].cnt0++;
+    SMimage[0].md[0].cnt1++;
+    clock_gettime(CLOCK_REALTIME, &SMimage[0].md[0].writetime);
+    ImageStreamIO_sempost(&SMimage[0], -1);
+}
+
+// pull the numbers we need out of runALPAO's exit report
+void parse_report(const char * report, runResult * result)
+{
+    const char * line = report;
+    char serial[MAX_STRLEN];
+
+    while (line != NULL && *line != '\0')
+    {
+        while (*line == ' ')
+        {
+            line++;
+        }
+        if (strncmp(line, "write -> sent", 13) == 0)
+        {
+            sscanf(line + 13, "%lu %lf %lf %lf %lf", &result->nlatency,
+                   &result->p50, &result->p99, &result->p999, &result->max);
+        } else
+        {
+            sscanf(line, "ALPAO %999s sent %lu commands", serial, &result->sent);
+        }
+        line = strchr(line, '\n');
+        if (line != NULL)
+        {
+            line++;
+        }
+    }
+}
+
+/* Count the frame commands in the mock DM's record and the rate they
+arrived at. The record holds the initial all-zero command, one vector per
+frame handled, and the all-zero reset on exit. */
+int read_sent_record(const char * path, int nbAct, runResult * result)
+{
+    FILE * fp;
+    uint64_t header[2];
+    uint64_t first = 0, last = 0, before_last = 0;
+    long nrec = 0;
+    size_t vecsize = nbAct * sizeof(double);
+
+    fp = fopen(path, "rb");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "benchALPAO: could not read %s\n", path);
+        return -1;
+    }
+    while (fread(header, sizeof(uint64_t), 2, fp) == 2 && fseek(fp, vecsize, SEEK_CUR) == 0)
+    {
+        // skip the initial command
+        if (nrec == 1)
+        {
+            first = header[1];
+        }
+        before_last = last;
+        last = header[1];
+        nrec++;
+    }
+    fclose(fp);
+
+    result->handled = nrec - 2;
+    if (result->handled < 0)
+    {
+        result->handled = 0;
+    }
+    // last is the reset, so the frame commands end at before_last
+    result->achieved_hz = 0;
+    if (result->handled > 1 && before_last > first)
+    {
+        result->achieved_hz = (result->handled - 1) / (1e-9 * (before_last - first));
+    }
+    return 0;
+}
+
+/* Start runALPAO with its stdout on a pipe. Returns the child pid. */
+pid_t start_runalpao(const char * runalpao, const char * shm_name, int flags,
+                     const char * extra, int * outfd)
+{
+    int pipefd[2];
+    pid_t pid;
+    const char * argv[MAX_CONFIGS];
+    char extra_copy[MAX_STRLEN];
+    char * token;
+    int argc = 0;
+
+    if (pipe(pipefd) == -1)
+    {
+        return -1;
+    }
+    argv[argc++] = runalpao;
+    argv[argc++] = BENCH_SERIAL;
+    argv[argc++] = shm_name;
+    if (flags & 1) argv[argc++] = "--nobias";
+    if (flags & 2) argv[argc++] = "--nonorm";
+    if (flags & 4) argv[argc++] = "--fractional";
+    if (extra != NULL)
+    {
+        // extra runALPAO options, split on spaces
+        strncpy(extra_copy, extra, MAX_STRLEN - 1);
+        extra_copy[MAX_STRLEN - 1] = '\0';
+        for (token = strtok(extra_copy, " "); token != NULL && argc < MAX_CONFIGS - 1;
+             token = strtok(NULL, " "))
+        {
+            argv[argc++] = token;
+        }
+    }
+    argv[argc] = NULL;
+
+    pid = fork();
+    if (pid == 0)
+    {
+        dup2(pipefd[1], STDOUT_FILENO);
+        close(pipefd[0]);
+        close(pipefd[1]);
+        execv(runalpao, (char * const *) argv);
+        perror("benchALPAO: exec runALPAO");
+        _exit(127);
+    }
+    close(pipefd[1]);
+    *outfd = pipefd[0];
+    return pid;
+}
+
+/* Run one configuration: start runALPAO, wait for it to take over the
+image, post nframes at rate_hz (0 = as fast as possible), stop it and
+collect its report. */
+int run_config(const char * runalpao, const char * extra, IMAGE * SMimage,
+               const char * shm_name, int flags, long nframes, double rate_hz, const char * record, int nbAct, runResult * result)
+{
+    pid_t pid;
+    int outfd, status;
+    uint64_t cnt0;
+    long frame;
+    struct timespec start, next;
+    unsigned int seed = 1;
+    char report[1 << 16];
+    ssize_t nread;
+    size_t used = 0;
+    double waited = 0;
+
+    memset(result, 0, sizeof(runResult));
+    cnt0 = SMimage[0].md[0].cnt0;
+    pid = start_runalpao(runalpao, shm_name, flags, extra, &outfd);
+    if (pid == -1)
+    {
+        return -1;
+    }
+
+    // runALPAO zeroes and posts the image once it is attached
+    while (SMimage[0].md[0].cnt0 == cnt0 && waited < 10)
+    {
+        usleep(1000);
+        waited += 1e-3;
+    }
+    if (SMimage[0].md[0].cnt0 == cnt0)
+    {
+        fprintf(stderr, "benchALPAO: runALPAO did not attach to %s\n", shm_name);
+        kill(pid, SIGKILL);
+        waitpid(pid, &status, 0);
+        close(outfd);
+        return -1;
+    }
+    // let it send the initial all-zero command and enter the loop
+    usleep(200000);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    next = start;
+    for ( frame = 0 ; frame < nframes ; frame++ )
+    {
+        if (rate_hz > 0)
+        {
+            next.tv_nsec += (long)(1e9 / rate_hz);
+            while (next.tv_nsec >= 1000000000)
+            {
+                next.tv_nsec -= 1000000000;
+                next.tv_sec++;
+            }
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+        }
+        post_frame(SMimage, &seed);
+    }
+
+    // give the loop time to finish what is queued, then stop it
+    usleep(200000);
+    // runALPAO wakes its own loops on SIGINT; a post here could be taken as a frame
+    kill(pid, SIGINT);
+
+    while ((nread = read(outfd, report + used, sizeof(report) - 1 - used)) > 0 ||
+           (nread == -1 && errno == EINTR))
+    {
+        if (nread > 0)
+        {
+            used += nread;
+        }
+    }
+    report[used] = '\0';
+    close(outfd);
+    waitpid(pid, &status, 0);
+
+    parse_report(report, result);
+    if (result->sent == 0)
+    {
+        fprintf(stderr, "benchALPAO: no report from runALPAO:\n%s\n", report);
+        return -1;
+    }
+    return read_sent_record(record, nbAct, result);
+}
+
+/*
+Argument parsing
+*/
+
+/* Program documentation. */
+static char doc[] =
+  "benchALPAO-- measure runALPAO update rate, dropped frames and write-to-send latency against the mock DM";
+
+/* A description of the arguments we accept. */
+static char args_doc[] = "";
+
+/* The options we understand. */
+static struct argp_option options[] = {
+  {"runalpao", 'r', "PATH", 0, "runALPAO binary built against the mock DM (default ./runALPAO_mock)" },
+  {"shm",      's', "NAME", 0, "Shared memory image name (default benchdm)" },
+  {"nbact",    'a', "N[,N...]", 0, "Actuator counts to sweep (default 97)" },
+  {"flags",    'F', "all|default", 0, "Sweep all nobias/nonorm/fractional combinations or only the default" },
+  {"rate",     'R', "HZ", 0, "Frame rate to post at; 0 posts as fast as possible (default 0)" },
+  {"frames",   'n', "N", 0, "Frames to post per configuration (default 10000)" },
+  {"latency",  'l', "SPEC", 0, "Mock DM send latency, as ALPAO_MOCK_LATENCY (default none)" },
+  {"output",   'o', "FILE", 0, "Write CSV results to FILE instead of stdout" },
+  {"extra",    'x', "OPTIONS", 0, "Extra options passed to runALPAO, e.g. \"--wait=spin --cpu=2\"" },
+  { 0 }
+};
+
+/* Used by main to communicate with parse_opt. */
+struct arguments
+{
+  const char *runalpao, *shm_name, *latency, *output, *extra;
+  int nbact[MAX_CONFIGS];
+  int n_nbact;
+  int allflags;
+  double rate;
+  long frames;
+};
+
+/* Parse a single option. */
+static error_t parse_opt (int key, char *arg, struct argp_state *state)
+{
+  struct arguments *arguments = state->input;
+  char *token;
+
+  switch (key)
+    {
+    case 'r':
+      arguments->runalpao = arg;
+      break;
+    case 's':
+      arguments->shm_name = arg;
+      break;
+    case 'a':
+      arguments->n_nbact = 0;
+      for (token = strtok(arg, ","); token != NULL && arguments->n_nbact < MAX_CONFIGS;
+           token = strtok(NULL, ","))
+        {
+          arguments->nbact[arguments->n_nbact++] = atoi(token);
+        }
+      break;
+    case 'F':
+      arguments->allflags = (strcmp(arg, "all") == 0);
+      break;
+    case 'R':
+      arguments->rate = strtod(arg, NULL);
+      break;
+    case 'n':
+      arguments->frames = atol(arg);
+      break;
+    case 'l':
+      arguments->latency = arg;
+      break;
+    case 'o':
+      arguments->output = arg;
+      break;
+    case 'x':
+      arguments->extra = arg;
+      break;
+
+    case ARGP_KEY_ARG:
+      /* No positional arguments. */
+      argp_usage (state);
+      break;
+
+    default:
+      return ARGP_ERR_UNKNOWN;
+    }
+  return 0;
+}
+
+/* Our argp parser. */
+static struct argp argp = { options, parse_opt, args_doc, doc };
+
+/* Remove the temporary ALPAO_CALIB directory and everything in it: the
+calibration written here, runALPAO's calibration cache and the mock
+DM's record */
+void remove_calibdir(const char * calibdir)
+{
+    char path[MAX_STRLEN];
+    DIR * dir;
+    struct dirent * entry;
+
+    dir = opendir(calibdir);
+    if (dir != NULL)
+    {
+        while ((entry = readdir(dir)) != NULL)
+        {
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            {
+                continue;
+            }
+            snprintf(path, MAX_STRLEN, "%s/%s", calibdir, entry->d_name);
+            unlink(path);
+        }
+        closedir(dir);
+    }
+    if (rmdir(calibdir) != 0)
+    {
+        fprintf(stderr, "benchALPAO: could not remove %s: %s\n", calibdir, strerror(errno));
+    }
+}
+
+/* Main program */
+int main( int argc, char ** argv )
+{
+    struct arguments arguments;
+    char calibdir[] = "/tmp/benchALPAO.XXXXXX";
+    char nbact_str[32];
+    char record[MAX_STRLEN];
+    IMAGE * SMimage = NULL;
+    FILE * out = stdout;
+    int dim;
+    runResult result;
+    int i, flags, nflags;
+    int failed = 0;
+
+    /* Default values. */
+    arguments.runalpao = "./runALPAO_mock";
+    arguments.shm_name = "benchdm";
+    arguments.latency = NULL;
+    arguments.output = NULL;
+    arguments.extra = NULL;
+    arguments.nbact[0] = 97;
+    arguments.n_nbact = 1;
+    arguments.allflags = 0;
+    arguments.rate = 0;
+    arguments.frames = 10000;
+
+    argp_parse (&argp, argc, argv, 0, 0, &arguments);
+
+    if (arguments.output != NULL)
+    {
+        out = fopen(arguments.output, "w");
+        if (out == NULL)
+        {
+            fprintf(stderr, "benchALPAO: could not open %s\n", arguments.output);
+            return -1;
+        }
+    }
+
+    if (mkdtemp(calibdir) == NULL)
+    {
+        perror("benchALPAO: mkdtemp");
+        return -1;
+    }
+    // runALPAO and the mock pick their configuration up from the environment
+    setenv("ALPAO_CALIB", calibdir, 1);
+    snprintf(record, MAX_STRLEN, "%s/sent.bin", calibdir);
+    setenv("ALPAO_MOCK_RECORD", record, 1);
+    if (arguments.latency != NULL)
+    {
+        setenv("ALPAO_MOCK_LATENCY", arguments.latency, 1);
+    }
+    // a broken pipe from a dead runALPAO should show up as a failed run
+    signal(SIGPIPE, SIG_IGN);
+
+    fprintf(out, "nbact,nobias,nonorm,fractional,target_hz,posted,handled,dropped,achieved_hz,"
+                 "write_to_send_p50_us,write_to_send_p99_us,write_to_send_p999_us,write_to_send_max_us\n");
+    nflags = arguments.allflags ? 8 : 1;
+    for ( i = 0 ; i < arguments.n_nbact ; i++ )
+    {
+        dim = grid_dim(arguments.nbact[i]);
+        if (write_calibration(calibdir, arguments.nbact[i], dim) == -1)
+        {
+            failed = 1;
+            continue;
+        }
+        // a new image for each grid size; runALPAO attaches to it
+        if (SMimage != NULL)
+        {
+            ImageStreamIO_destroyIm(&SMimage[0]);
+            free(SMimage);
+        }
+        SMimage = create_stream(arguments.shm_name, dim);
+        snprintf(nbact_str, sizeof(nbact_str), "%d", arguments.nbact[i]);
+        setenv("ALPAO_MOCK_NBACT", nbact_str, 1);
+
+        for ( flags = 0 ; flags < nflags ; flags++ )
+        {
+            fprintf(stderr, "benchALPAO: %d actuators, nobias=%d nonorm=%d fractional=%d\n",
+                    arguments.nbact[i], flags & 1, (flags >> 1) & 1, (flags >> 2) & 1);
+            if (run_config(arguments.runalpao, arguments.extra, SMimage, arguments.shm_name, flags,
+                           arguments.frames, arguments.rate, record, arguments.nbact[i],
+                           &result) == -1)
+            {
+                failed = 1;
+                continue;
+            }
+            fprintf(out, "%d,%d,%d,%d,%.1f,%ld,%ld,%ld,%.1f,%.2f,%.2f,%.2f,%.2f\n",
+                    arguments.nbact[i], flags & 1, (flags >> 1) & 1, (flags >> 2) & 1,
+                    arguments.rate, arguments.frames, result.handled,
+                    arguments.frames - result.handled, result.achieved_hz,
+                    result.p50, result.p99, result.p999, result.max);
+            fflush(out);
+        }
+    }
+
+    if (out != stdout)
+    {
+        fclose(out);
+    }
+    if (SMimage != NULL)
+    {
+        ImageStreamIO_destroyIm(&SMimage[0]);
+        free(SMimage);
+    }
+    remove_calibdir(calibdir);
+    return failed ? -1 : 0;
+}
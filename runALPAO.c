@@ -1,6 +1,6 @@
 /*
 To compile:
->>>gcc runALPAO.c -o build/runALPAO -lImageStreamIO -lasdk -lpthread -lrt -lcfitsio
+>>>gcc runALPAO.c -o build/runALPAO -lImageStreamIO -lasdk -lpthread -lrt -lcfitsio -lm
 
 (You must already have the ALPAO SDK and cacao/milk installed.)
 
@@ -23,18 +23,42 @@ export ACECFG=$HOME/ALPAO/Config
 where Config contains the ALPAO configuration files as well as the user-defined
 calibration file <serial>_userconfig.txt
 
-Still to be implemented or determined:
--Multiplexed virtual DM
+To drive several DMs from one process, one loop thread per mirror:
+>>>./runALPAO bax449 dm449 bax450 dm450 --cpu=2,3 --rtprio=80
+To sum several independent producers into one command (virtual DM):
+>>>./runALPAO <serialnumber> <shm_name> --channels=4
 */
 
+#define _GNU_SOURCE // sched_setaffinity and the CPU_* macros
+
 /* System Headers */
 #include <stdio.h>
 #include <stdlib.h>
+#include <assert.h>
+#include <malloc.h>
 #include <unistd.h>
 #include <stddef.h>
 #include <signal.h>
 #include <argp.h>
 #include <string.h>
+#include <math.h>
+#include <stdint.h>
+#include <time.h>
+#include <sched.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <poll.h>
+#include <sys/inotify.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#endif
 
 /* cacao */
 #include "ImageStruct.h"   // cacao data structure definition
@@ -47,22 +71,51 @@ Still to be implemented or determined:
 #include "fitsio.h"
 
 #define MAX_STRLEN 1000
+#define CACHE_LINE 64 // alignment (bytes) of the per-session command buffers
 
 
-// interrupt signal handling for safe DM shutdown
+/* Set by the control plane (main) on SIGINT, or when any mirror's loop
+fails, for a safe shutdown of every DM */
 volatile sig_atomic_t stop;
 
-void handle_signal(int signal)
+/* Element types the input image may have (--dtype). The conversion
+kernels are instantiated for each, so a producer can write whatever it
+computes in without converting for us. int16 pixels are multiplied by
+--int16-scale to get the units a float image would be in. */
+enum { INPUT_FLOAT, INPUT_DOUBLE, INPUT_INT16, N_INPUT_TYPES };
+
+typedef struct
+{
+    const char * name;
+    uint8_t datatype;  // ImageStreamIO _DATATYPE_*
+    size_t size;
+} inputType;
+
+static const inputType input_types[N_INPUT_TYPES] = {
+    {"float",  _DATATYPE_FLOAT,  sizeof(float)},
+    {"double", _DATATYPE_DOUBLE, sizeof(double)},
+    {"int16",  _DATATYPE_INT16,  sizeof(int16_t)},
+};
+
+// INPUT_* for an ImageStreamIO datatype, -1 if the loop can't read it
+int input_type_of(uint8_t datatype)
 {
-    if (signal == SIGINT)
+    int dtype;
+
+    for ( dtype = 0 ; dtype < N_INPUT_TYPES ; dtype++ )
     {
-        printf("\nExiting the ALPAO control loop.\n");
-        stop = 1;
+        if (input_types[dtype].datatype == datatype)
+        {
+            return dtype;
+        }
     }
+    return -1;
 }
 
-// Initialize the shared memory image
-void initializeSharedMemory(const char * shm_name, int ax1, int ax2)
+/* Initialize the shared memory image with elements of type dtype, or,
+with dtype -1, of whatever supported type an existing image has (float
+for a new one). Returns the type used. */
+int initializeSharedMemory(const char * shm_name, int ax1, int ax2, int dtype)
 {
     long naxis; // number of axis
     uint8_t atype;     // data type
@@ -79,9 +132,6 @@ void initializeSharedMemory(const char * shm_name, int ax1, int ax2)
     imsize[0] = ax1;
     imsize[1] = ax2;
     
-    // image will be float type
-    // see file ImageStruct.h for list of supported types
-    atype = _DATATYPE_FLOAT;
     // image will be in shared memory
     shared = 1;
     // allocate space for 10 keywords
@@ -90,8 +140,35 @@ void initializeSharedMemory(const char * shm_name, int ax1, int ax2)
     // Circular bufer of 10 vectors
     CBsize = 10;
     
-    // create an image in shared memory
-    ImageStreamIO_createIm(&SMimage[0], shm_name, naxis, imsize, atype, shared, NBkw, CBsize);
+    /* reuse an existing image of the right shape and type, so producers
+    (and benchmarks) already attached to it stay connected; otherwise
+    create an image in shared memory */
+    int reuse = 0;
+    if (ImageStreamIO_openIm(&SMimage[0], shm_name) == 0)
+    {
+        reuse = (SMimage[0].md[0].naxis == naxis &&
+                 SMimage[0].md[0].size[0] == imsize[0] &&
+                 SMimage[0].md[0].size[1] == imsize[1] &&
+                 (dtype == -1 ? input_type_of(SMimage[0].md[0].datatype) != -1 :
+                                SMimage[0].md[0].datatype == input_types[dtype].datatype));
+        if (!reuse)
+        {
+            ImageStreamIO_closeIm(&SMimage[0]);
+        }
+    }
+    if (reuse)
+    {
+        dtype = input_type_of(SMimage[0].md[0].datatype);
+    } else
+    {
+        // see file ImageStruct.h for list of supported types
+        if (dtype == -1)
+        {
+            dtype = INPUT_FLOAT;
+        }
+        atype = input_types[dtype].datatype;
+        ImageStreamIO_createIm(&SMimage[0], shm_name, naxis, imsize, atype, shared, NBkw, CBsize);
+    }
 
     /* flush all semaphores to avoid commanding the DM from a 
     backlog in shared memory */
@@ -99,11 +176,10 @@ void initializeSharedMemory(const char * shm_name, int ax1, int ax2)
     
     // write 0s to the image
     SMimage[0].md[0].write = 1; // set this flag to 1 when writing data
-    int i;
-    for (i = 0; i < ax1*ax2; i++)
-    {
-      SMimage[0].array.F[i] = 0.;
-    }
+    memset(SMimage[0].array.raw, 0, (size_t) ax1 * ax2 * input_types[dtype].size);
+
+    // stamp the write so latency measurements of the first command are meaningful
+    clock_gettime(CLOCK_REALTIME, &SMimage[0].md[0].writetime);
 
     // post all semaphores
     ImageStreamIO_sempost(&SMimage[0], -1);
@@ -111,27 +187,39 @@ void initializeSharedMemory(const char * shm_name, int ax1, int ax2)
     SMimage[0].md[0].write = 0; // Done writing data
     SMimage[0].md[0].cnt0++;
     SMimage[0].md[0].cnt1++;
+    return dtype;
 }
 
 
+/* Flag a clipped actuator in the per-frame saturation mask. Returns 1 so
+kernels can count saturations as they go. */
+static inline int mark_saturated(uint8_t * satmask, int idx)
+{
+    satmask[idx] = 1;
+    return 1;
+}
+
 /* Convert any DM inputs with an absolute fractional stroke
-> 1 to 1 to avoid exceeding safe DM operation. */
-void clip_to_limits(Scalar * dminputs, int nbAct)
+> 1 to 1 to avoid exceeding safe DM operation. Clipped actuators are
+flagged in satmask; returns the number clipped. */
+int clip_to_limits(Scalar * dminputs, uint8_t * satmask, int nbAct)
 {
     int idx;
+    int nsat = 0;
     // check each actuator and clip if needed
     for ( idx = 0 ; idx < nbAct ; idx++)
     {
         if (dminputs[idx] > 1)
         {
-            printf("Actuator %d saturated!\n", idx + 1);
+            nsat += mark_saturated(satmask, idx);
             dminputs[idx] = 1;
         } else if (dminputs[idx] < -1)
         {
-            printf("Actuator %d saturated!\n", idx + 1);
+            nsat += mark_saturated(satmask, idx);
             dminputs[idx] = - 1;
         }
     }
+    return nsat;
 }
 
 /* ASDK expects inputs between -1 and +1, but we'd like to provide
@@ -182,34 +270,50 @@ void bias_inputs(Scalar * dminputs, int nbAct)
     }
 }
 
+/* Build the path of a calibration file for this DM:
+$ALPAO_CALIB/<serial in lower case><suffix> */
+int calibration_path(const char * serial, const char * suffix, char * path, size_t pathlen)
+{
+    char * alpao_calib;
+    char serial_lc[MAX_STRLEN];
+    int i;
+
+    // force serial to be lower case
+    for ( i = 0 ; serial[i] && i < MAX_STRLEN - 1 ; i++ )
+    {
+        serial_lc[i] = tolower(serial[i]);
+    }
+    serial_lc[i] = '\0';
+
+    // find calibration file location from alpao_calib env variable
+    alpao_calib = getenv("ALPAO_CALIB");
+    if (alpao_calib == NULL)
+    {
+        printf("ALPAO %s: ALPAO_CALIB is not set\n", serial);
+        return -1;
+    }
+    snprintf(path, pathlen, "%s/%s%s", alpao_calib, serial_lc, suffix);
+    return 0;
+}
+
 /* Read in a configuration file with user-calibrated
 values to determine the conversion from physical to
 fractional stroke as well as the volume displaced by
 the influence function. */
 int parse_calibration_file(const char * serial, Scalar *max_stroke, Scalar *volume_factor)
 {
-    char * alpao_calib;
-    char calibname[MAX_STRLEN*3];
     char calibpath[MAX_STRLEN*3];
-    char serial_lc[MAX_STRLEN];
     FILE * fp;
     char * line = NULL;
     size_t len = 0;
     ssize_t read;
-    char * token;
-    Scalar * calibvals;
+    Scalar calibvals[2] = {0, 0};
 
-    // force serial to be lower case
-    for(int i = 0; serial[i]; i++){
-      serial_lc[i] = tolower(serial[i]);
+    if (calibration_path(serial, "_userconfig.txt", calibpath, sizeof(calibpath)) == -1)
+    {
+        return -1;
     }
 
-    // find calibration file location from alpao_calib env variable
-    alpao_calib = getenv("ALPAO_CALIB");
-    strncpy(calibpath, alpao_calib, MAX_STRLEN);
-    snprintf(calibname, MAX_STRLEN*3, "/%s_userconfig.txt", serial_lc);
-    strncat(calibpath, calibname, MAX_STRLEN);
-
     // open file
     fp = fopen(calibpath, "r");
     if (fp == NULL)
@@ -218,14 +322,14 @@ int parse_calibration_file(const char * serial, Scalar *max_stroke, Scalar *volu
         return -1;
     }
 
-    calibvals = (Scalar*) malloc(2*sizeof(Scalar));
     int idx = 0;
-    while ((read = getline(&line, &len, fp)) != -1)
+    while ((read = getline(&line, &len, fp)) != -1 && idx < 2)
     {
         // grab first value from each line
         calibvals[idx] = strtod(line, NULL);
         idx++;
     }
+    free(line);
 
     fclose(fp);
 
@@ -237,7 +341,10 @@ int parse_calibration_file(const char * serial, Scalar *max_stroke, Scalar *volu
     return 0;
 }
 
-int get_actuator_mapping(const char * serial, int nbAct, int * actuator_mapping)
+/* Read the actuator map: the indices of the active actuators (pixels > 0)
+in the 2D cacao image, in the order the ALPAO SDK expects. The list is
+allocated here; map_size gets the image axes. */
+int read_actuator_mapping(const char * serial, int ** mapping, int * nmap, int * map_size)
 {
     /* This function closely follows the CFITSIO imstat
     example */
@@ -246,334 +353,5464 @@ int get_actuator_mapping(const char * serial, int nbAct, int * actuator_mapping)
     int status = 0;  /* CFITSIO status value MUST be initialized to zero! */
     int hdutype, naxis, ii;
     long naxes[2], totpix, fpixel[2];
-    int *pix;
+    int *pix = NULL;
     int ij = 0; /* actuator mapping index */
 
-    char * alpao_calib;
-    char calibname[MAX_STRLEN*3];
     char calibpath[MAX_STRLEN*3];
-    char serial_lc[MAX_STRLEN];
 
     // get file path to actuator map
+    if (calibration_path(serial, "_actuator_mapping.fits", calibpath, sizeof(calibpath)) == -1)
+    {
+        return -1;
+    }
 
-    // force serial to be lower case
-    for(int i = 0; serial[i]; i++){
-      serial_lc[i] = tolower(serial[i]);
+    if ( fits_open_image(&fptr, calibpath, READONLY, &status) )
+    {
+        fits_report_error(stderr, status); /* print any error message */
+        printf("ALPAO %s: could not open the actuator mapping %s\n", serial, calibpath);
+        return -1;
     }
 
-    alpao_calib = getenv("ALPAO_CALIB");
-    strncpy(calibpath, alpao_calib, MAX_STRLEN);
-    snprintf(calibname, MAX_STRLEN*3, "/%s_actuator_mapping.fits", serial_lc);
-    strncat(calibpath, calibname, MAX_STRLEN);
+    if (fits_get_hdu_type(fptr, &hdutype, &status) || hdutype != IMAGE_HDU) { 
+      printf("Error: this program only works on images, not tables\n");
+      fits_close_file(fptr, &status);
+      return -1;
+    }
 
-    if ( !fits_open_image(&fptr, calibpath, READONLY, &status) )
-    {
-      if (fits_get_hdu_type(fptr, &hdutype, &status) || hdutype != IMAGE_HDU) { 
-        printf("Error: this program only works on images, not tables\n");
-        return(1);
-      }
+    fits_get_img_dim(fptr, &naxis, &status);
+    fits_get_img_size(fptr, 2, naxes, &status);
 
-      fits_get_img_dim(fptr, &naxis, &status);
-      fits_get_img_size(fptr, 2, naxes, &status);
+    if (status || naxis != 2) { 
+      printf("Error: NAXIS = %d.  Only 2-D images are supported.\n", naxis);
+      fits_close_file(fptr, &status);
+      return -1;
+    }
+
+    totpix = naxes[0] * naxes[1];
+    pix = (int *) malloc(naxes[0] * sizeof(int)); /* memory for 1 row */
+    *mapping = (int *) malloc(totpix * sizeof(int)); /* at most every pixel is active */
+
+    if (pix == NULL || *mapping == NULL) {
+      printf("Memory allocation error\n");
+      free(pix);
+      free(*mapping);
+      fits_close_file(fptr, &status);
+      return -1;
+    }
 
-      if (status || naxis != 2) { 
-        printf("Error: NAXIS = %d.  Only 2-D images are supported.\n", naxis);
-        return(1);
-      }
+    fpixel[0] = 1;  /* read starting with first pixel in each row */
 
-      pix = (int *) malloc(naxes[0] * sizeof(int)); /* memory for 1 row */
+    /* process image one row at a time; increment row # in each loop */
+    //for (fpixel[1] = 1; fpixel[1] <= naxes[1]; fpixel[1]++)
+    for (fpixel[1] = naxes[1]; fpixel[1] >= 1; fpixel[1]--)
+    {  
+       /* give starting pixel coordinate and number of pixels to read */
+       if (fits_read_pix(fptr, TINT, fpixel, naxes[0],0, pix,0, &status))
+          break;   /* jump out of loop on error */
 
-      if (pix == NULL) {
-        printf("Memory allocation error\n");
-        return(1);
-      }
-
-      totpix = naxes[0] * naxes[1];
-      fpixel[0] = 1;  /* read starting with first pixel in each row */
-
-      /* process image one row at a time; increment row # in each loop */
-      //for (fpixel[1] = 1; fpixel[1] <= naxes[1]; fpixel[1]++)
-      for (fpixel[1] = naxes[1]; fpixel[1] >= 1; fpixel[1]--)
-      {  
-         /* give starting pixel coordinate and number of pixels to read */
-         if (fits_read_pix(fptr, TINT, fpixel, naxes[0],0, pix,0, &status))
-            break;   /* jump out of loop on error */
-
-         // get indices of active actuators in order
-         for (ii = 0; ii < naxes[0]; ii++) {
-           if (pix[ii] > 0) {
-                actuator_mapping[ij] = (fpixel[1]-1) * naxes[0] + ii;
-                ij++;
-           }
+       // get indices of active actuators in order
+       for (ii = 0; ii < naxes[0]; ii++) {
+         if (pix[ii] > 0) {
+              (*mapping)[ij] = (fpixel[1]-1) * naxes[0] + ii;
+              ij++;
          }
-      }
-      fits_close_file(fptr, &status);
+       }
     }
+    fits_close_file(fptr, &status);
+    free(pix);
 
     if (status)  {
         fits_report_error(stderr, status); /* print any error message */
+        free(*mapping);
+        return -1;
     }
 
-    free(pix);
-
+    *nmap = ij;
+    map_size[0] = naxes[0];
+    map_size[1] = naxes[1];
     printf("ALPAO %s: Using actuator mapping from %s\n", serial, calibpath);
     return 0;
 }
 
-/* Send command to mirror from shared memory */
-int sendCommand(asdkDM * dm, IMAGE * SMimage, int nbAct, int nobias, int nonorm,
-		int fractional, Scalar max_stroke, Scalar volume_factor,
-		int * actuator_mapping)
+/* Everything runALPAO needs from the calibration files: the stroke and
+volume scales from <serial>_userconfig.txt and the gather index and
+geometry from <serial>_actuator_mapping.fits. */
+typedef struct
 {
-    COMPL_STAT ret;
-    int idx;
-    Scalar * dminputs;
+    Scalar max_stroke;
+    Scalar volume_factor;
+    int map_size[2];          // axes of the mapping image
+    int nmap;                 // active actuators in the mapping
+    int * mapping;            // gather index, nmap entries
+    void * cache;             // mmapped cache the mapping points into, or NULL
+    size_t cache_size;
+} calibration;
 
-    // Cast to array type ALPAO expects
-    // Scalar = double
-    // Shared memory image = float
-    dminputs = (Scalar*) calloc( nbAct, sizeof( Scalar ) );
-    for ( idx = 0 ; idx < nbAct ; idx++ )
-    {
-        // use actuator mapping to pull correct element of shared memory image
-        dminputs[idx] = (Scalar)SMimage[0].array.F[actuator_mapping[idx]];
-    }
+/* Binary calibration cache, <serial>_calib.cache next to the sources.
+Parsing the userconfig and going through CFITSIO for the map takes much
+longer than a restart after a fault should, so the parsed calibration
+is written once as a header and the gather index, and later starts
+mmap it. The header records the size and modification time of both
+sources; a cache whose stamps don't match, or whose version or checksum
+is wrong, is rebuilt from the sources. It is written to a temporary
+file and renamed into place, so a reader never sees half a cache. */
+#define CALIB_CACHE_MAGIC "ALPAOCAL"
+#define CALIB_CACHE_VERSION 1
 
-    // First, convert raw displacements to volume-normalized displacements (microns)
-    if (nonorm != 1)
-    {
-        normalize_inputs(dminputs, nbAct, volume_factor);
-    }
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t checksum;        // FNV-1a 64 of everything after this field
+    int64_t config_mtime_ns;  // source stamps the cache was built from
+    int64_t config_size;
+    int64_t mapping_mtime_ns;
+    int64_t mapping_size;
+    double max_stroke;
+    double volume_factor;
+    uint32_t map_size[2];
+    uint32_t nmap;
+    uint32_t flags;           // reserved, 0
+} calibCacheHeader;
 
-    /* Second, convert from displacement (in microns) to fractional
-    stroke (-1 to +1) that the ALPAO SDK expects */
-    if (fractional != 1)
-    {
-        microns_to_fractional_stroke(dminputs, nbAct, max_stroke);
-    }
-    // Third, remove DC bias in inputs
-    if (nobias != 1)
+static uint64_t fnv1a(uint64_t hash, const void * data, size_t nbytes)
+{
+    const uint8_t * bytes = (const uint8_t *) data;
+    size_t i;
+
+    for ( i = 0 ; i < nbytes ; i++ )
     {
-        bias_inputs(dminputs, nbAct);
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
     }
+    return hash;
+}
 
-    /* Fourth, clip to fractional values between -1 and 1.
-    The ALPAO SDK doesn't seem to check for this, which
-    is scary and a little odd. */
-    clip_to_limits(dminputs, nbAct);
-
-    //for (idx = 0; idx < nbAct; idx++) {
-    //    printf("Act %d: %f\n", idx, dminputs[idx]);
-    //} 
-
-    /* Finally, send the command to the DM */
-    ret = asdkSend(dm, dminputs);
-
-    /* Release memory */
-    free( dminputs );
+static uint64_t calib_cache_checksum(const calibCacheHeader * hdr, const int32_t * mapping)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    size_t start = offsetof(calibCacheHeader, checksum) + sizeof(hdr->checksum);
 
-    return ret;
+    hash = fnv1a(hash, (const char *) hdr + start, sizeof(calibCacheHeader) - start);
+    return fnv1a(hash, mapping, hdr->nmap * sizeof(int32_t));
 }
 
-// intialize DM and shared memory and enter DM command loop
-int controlLoop(const char * serial, const char * shm_name, int nobias, int nonorm, int fractional)
+// size and modification time of a calibration source
+static int source_stamp(const char * serial, const char * suffix, int64_t * mtime_ns, int64_t * size)
 {
-    int n, idx;
-    UInt nbAct;
-    COMPL_STAT ret;
-    Scalar     tmp;
-    IMAGE * SMimage;
-    Scalar max_stroke;
-    Scalar volume_factor;
-    int *actuator_mapping;
-    int shm_dim = 20;
-
-    /* get max stroke and volume normalization factor from
-    the user-defined config file */
-    ret = parse_calibration_file(serial, &max_stroke, &volume_factor);
+    char path[MAX_STRLEN*3];
+    struct stat st;
 
-    if (ret == -1)
+    if (calibration_path(serial, suffix, path, sizeof(path)) == -1 || stat(path, &st) == -1)
     {
         return -1;
     }
+    *mtime_ns = (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    *size = st.st_size;
+    return 0;
+}
 
-    //initialize DM
-    asdkDM * dm = NULL;
-    dm = asdkInit(serial);
-    if (dm == NULL)
+static int source_stamps(const char * serial, calibCacheHeader * hdr)
+{
+    if (source_stamp(serial, "_userconfig.txt", &hdr->config_mtime_ns, &hdr->config_size) == -1 ||
+        source_stamp(serial, "_actuator_mapping.fits", &hdr->mapping_mtime_ns, &hdr->mapping_size) == -1)
     {
         return -1;
     }
+    return 0;
+}
 
-    // Get number of actuators
-    ret = asdkGet( dm, "NbOfActuator", &tmp );
-    if (ret == -1)
+/* Map the cache if it is current; returns -1 (and leaves cal alone) if it
+is missing, stale or corrupt */
+static int load_calib_cache(const char * serial, const char * path, calibration * cal)
+{
+    calibCacheHeader now;
+    const calibCacheHeader * hdr;
+    struct stat st;
+    void * map;
+    int fd;
+
+    memset(&now, 0, sizeof(now));
+    if (source_stamps(serial, &now) == -1)
     {
         return -1;
     }
-    nbAct = (UInt) tmp;
-
-    /* get actuator mapping from 2D cacao image to 1D vector for
-    ALPAO input */
-    actuator_mapping = (int *) malloc(nbAct * sizeof(int)); /* memory for actuator mapping */
-    get_actuator_mapping(serial, nbAct, actuator_mapping);
-
-    // initialize shared memory image to 0s
-    initializeSharedMemory(shm_name, shm_dim, shm_dim);
-
-    // connect to shared memory image (SMimage)
-    SMimage = (IMAGE*) malloc(sizeof(IMAGE));
-    ImageStreamIO_read_sharedmem_image_toIMAGE(shm_name, &SMimage[0]);
-
-    // Validate SMimage dimensionality and size against DM
-    if (SMimage[0].md[0].naxis != 2) {
-        printf("SM image naxis = %d\n", SMimage[0].md[0].naxis);
+    fd = open(path, O_RDONLY);
+    if (fd == -1)
+    {
         return -1;
     }
-    if (SMimage[0].md[0].size[0] != shm_dim) {
-        printf("SM image size (axis 1) = %d", SMimage[0].md[0].size[0]);
+    if (fstat(fd, &st) == -1 || (size_t) st.st_size < sizeof(calibCacheHeader))
+    {
+        close(fd);
         return -1;
     }
-    if (SMimage[0].md[0].size[1] != shm_dim) {
-        printf("SM image size (axis 2) = %d", SMimage[0].md[0].size[1]);
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
         return -1;
     }
 
-    // set DM to all-0 state to begin
-    printf("ALPAO %s: initializing all actuators to 0.\n", serial);
-    ImageStreamIO_semwait(&SMimage[0], 0);
-    //printf("%f\n%f\n", max_stroke, volume_factor);
-    ret = sendCommand(dm, SMimage, nbAct, nobias, nonorm, fractional, max_stroke, volume_factor, actuator_mapping);
-    if (ret == -1)
+    hdr = (const calibCacheHeader *) map;
+    if (memcmp(hdr->magic, CALIB_CACHE_MAGIC, 8) != 0 ||
+        hdr->version != CALIB_CACHE_VERSION ||
+        hdr->header_size != sizeof(calibCacheHeader) ||
+        (size_t) st.st_size != sizeof(calibCacheHeader) + hdr->nmap * sizeof(int32_t) ||
+        hdr->config_mtime_ns != now.config_mtime_ns || hdr->config_size != now.config_size ||
+        hdr->mapping_mtime_ns != now.mapping_mtime_ns || hdr->mapping_size != now.mapping_size ||
+        hdr->checksum != calib_cache_checksum(hdr, (const int32_t *)(hdr + 1)))
     {
+        munmap(map, st.st_size);
         return -1;
     }
 
-    // SIGINT handling
-    struct sigaction action;
-    action.sa_flags = SA_SIGINFO;
-    action.sa_handler = handle_signal;
-    sigaction(SIGINT, &action, NULL);
-    stop = 0;
+    cal->max_stroke = hdr->max_stroke;
+    cal->volume_factor = hdr->volume_factor;
+    cal->map_size[0] = hdr->map_size[0];
+    cal->map_size[1] = hdr->map_size[1];
+    cal->nmap = hdr->nmap;
+    cal->mapping = (int *)(hdr + 1);
+    cal->cache = map;
+    cal->cache_size = st.st_size;
+    return 0;
+}
 
-    // control loop
-    while (!stop)
-    {
-        //printf("ALPAO %s: waiting on commands.\n", serial);
-        // Wait on semaphore update
-        ImageStreamIO_semwait(&SMimage[0], 0);
-        
-        // Send Command to DM
-        if (!stop) // Skip DM on interrupt signal
-        {
-            //printf("ALPAO %s: sending command with nobias=%d, nonorm=%d, and fractional=%d.\n", serial, nobias, nonorm, fractional);
-            ret = sendCommand(dm, SMimage, nbAct, nobias, nonorm, fractional, max_stroke, volume_factor, actuator_mapping);
-            if (ret == -1)
-            {
-                return -1;
-            }
-        }
-    }
+static void write_calib_cache(const char * serial, const char * path, const calibration * cal,
+                              const calibCacheHeader * stamps)
+{
+    char tmppath[MAX_STRLEN*3 + 32];
+    calibCacheHeader hdr;
+    FILE * fp;
+    int ok;
 
-    // Safe DM shutdown on interrupt
-    printf("ALPAO %s: resetting and releasing DM.\n", serial);
-    // Reset and release ALPAO
-    asdkReset(dm);
-    ret = asdkRelease(dm);
-    dm = NULL;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, CALIB_CACHE_MAGIC, 8);
+    hdr.version = CALIB_CACHE_VERSION;
+    hdr.header_size = sizeof(calibCacheHeader);
+    hdr.config_mtime_ns = stamps->config_mtime_ns;
+    hdr.config_size = stamps->config_size;
+    hdr.mapping_mtime_ns = stamps->mapping_mtime_ns;
+    hdr.mapping_size = stamps->mapping_size;
+    hdr.max_stroke = cal->max_stroke;
+    hdr.volume_factor = cal->volume_factor;
+    hdr.map_size[0] = cal->map_size[0];
+    hdr.map_size[1] = cal->map_size[1];
+    hdr.nmap = cal->nmap;
+    hdr.checksum = calib_cache_checksum(&hdr, (const int32_t *) cal->mapping);
 
-    return ret;
+    snprintf(tmppath, sizeof(tmppath), "%s.tmp.%d", path, (int) getpid());
+    fp = fopen(tmppath, "wb");
+    if (fp == NULL)
+    {
+        printf("ALPAO %s: could not write calibration cache %s: %s\n", serial, tmppath, strerror(errno));
+        return;
+    }
+    ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1 &&
+         fwrite(cal->mapping, sizeof(int32_t), cal->nmap, fp) == (size_t) cal->nmap;
+    ok = (fclose(fp) == 0) && ok;
+    if (!ok || rename(tmppath, path) == -1)
+    {
+        printf("ALPAO %s: could not write calibration cache %s\n", serial, path);
+        unlink(tmppath);
+        return;
+    }
+    printf("ALPAO %s: wrote calibration cache %s\n", serial, path);
 }
 
-/*
-Argument parsing
-*/
-
-/* Program documentation. */
-static char doc[] =
-  "runALPAO-- enter the ALPAO DM <serial> command loop and wait for cacao shared memory images to be posted at <shm_name>";
+/* Load the calibration, from the cache when it is current and from the
+sources (rebuilding the cache) otherwise */
+int load_calibration(const char * serial, calibration * cal)
+{
+    char path[MAX_STRLEN*3];
+    calibCacheHeader stamps;
 
-/* A description of the arguments we accept. */
-static char args_doc[] = "serial shm_name";
+    memset(cal, 0, sizeof(calibration));
+    if (calibration_path(serial, "_calib.cache", path, sizeof(path)) == -1)
+    {
+        return -1;
+    }
+    if (load_calib_cache(serial, path, cal) == 0)
+    {
+        printf("ALPAO %s: Using cached calibration from %s\n", serial, path);
+        return 0;
+    }
 
-/* The options we understand. */
-static struct argp_option options[] = {
-  {"nobias",     'b', 0, 0,  "Disable automatically biasing the DM (enabled by default)" },
-  {"nonorm",     'n', 0, 0,  "Disable displacement normalization (enabled by default)" },
-  {"fractional", 'f', 0, 0,  "Give inputs in fractional stroke (-1 to +1) rather than microns" },
-  { 0 }
-};
+    // stamp the sources before reading them, so an edit during the parse makes the cache stale
+    memset(&stamps, 0, sizeof(stamps));
+    if (source_stamps(serial, &stamps) == -1)
+    {
+        printf("ALPAO %s: calibration files missing from ALPAO_CALIB\n", serial);
+    }
+    if (parse_calibration_file(serial, &cal->max_stroke, &cal->volume_factor) == -1 ||
+        read_actuator_mapping(serial, &cal->mapping, &cal->nmap, cal->map_size) == -1)
+    {
+        return -1;
+    }
+    write_calib_cache(serial, path, cal, &stamps);
+    return 0;
+}
 
-/* Used by main to communicate with parse_opt. */
-struct arguments
+void free_calibration(calibration * cal)
 {
-  const char *args[2];    /* serial and shared memory name */
-  int nobias, nonorm, fractional;
-};
+    if (cal->cache != NULL)
+    {
+        munmap(cal->cache, cal->cache_size);
+    } else
+    {
+        free(cal->mapping);
+    }
+    cal->mapping = NULL;
+    cal->cache = NULL;
+}
 
-/* Parse a single option. */
-static error_t parse_opt (int key, char *arg, struct argp_state *state)
+/* Buffers owned by the control loop for the whole session. Everything
+sendCommand() touches is allocated here once, before the loop starts, so
+the per-frame path never goes to the heap. */
+typedef struct
 {
-  /* Get the input argument from argp_parse, which we
-     know is a pointer to our arguments structure. */
-  struct arguments *arguments = state->input;
-
-  switch (key)
-    {
-    case 'b':
-      arguments->nobias = 1;
-      break;
-    case 'n':
-      arguments->nonorm = 1;
-      break;
-    case 'f':
-      arguments->fractional = 1;
+    Scalar * dminputs;     // cache-line-aligned command vector passed to asdkSend
+    const Scalar * command; // what send_frame() sends: dminputs, or in --direct mode the input
+    const void * input;    // image the command was converted from
+    uint8_t * satmask;     // 1 for each actuator clipped in the current frame
+    int nsat;              // number of actuators clipped in the current frame
+    int nbAct;
+    unsigned long nframes; // commands sent using these buffers
+    const IMAGE * ring;    // --direct: the input ring, while command points into it
+    uint64_t ring_cnt0;    // --direct: its cnt0 when the slice was taken
+    unsigned long nresent; // --direct: slices rewritten during a send, resent from a copy
+} commandBuffers;
 
-    case ARGP_KEY_ARG:
-      if (state->arg_num >= 2)
-        /* Too many arguments. */
-        argp_usage (state);
+/* Heap use of the hot path. The mock build (asdkMock.c) counts the
+allocations each thread makes, so the loop and sender threads can show
+they made none. With the real SDK there is no counter, and the exit
+report falls back to how much the heap grew while the loop ran. */
+unsigned long asdkMockHeapAllocs(void) __attribute__((weak));
 
-      arguments->args[state->arg_num] = arg;
+typedef struct
+{
+    unsigned long allocs; // allocations by the calling thread (mock build)
+    size_t in_use;        // heap bytes in use, all threads
+} heapMark;
 
-      break;
+void heap_mark(heapMark * m)
+{
+    struct mallinfo2 mi = mallinfo2();
 
-    case ARGP_KEY_END:
-      if (state->arg_num < 2)
-        /* Not enough arguments. */
-        argp_usage (state);
-      break;
+    m->allocs = asdkMockHeapAllocs != NULL ? asdkMockHeapAllocs() : 0;
+    m->in_use = mi.uordblks + mi.hblkhd;
+}
 
-    default:
-      return ARGP_ERR_UNKNOWN;
+/* Allocate zeroed, cache-line-aligned memory for the command path */
+void * command_alloc(size_t nbytes)
+{
+    void * ptr;
+    // round up so the buffer fills whole cache lines
+    nbytes = (nbytes + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+    if (posix_memalign(&ptr, CACHE_LINE, nbytes) != 0)
+    {
+        return NULL;
     }
-  return 0;
+    memset(ptr, 0, nbytes);
+    return ptr;
+}
+
+int init_command_buffers(commandBuffers * buf, int nbAct)
+{
+    buf->nframes = 0;
+    buf->nsat = 0;
+    buf->nbAct = nbAct;
+    buf->ring = NULL;
+    buf->nresent = 0;
+    buf->dminputs = (Scalar*) command_alloc(nbAct * sizeof(Scalar));
+    buf->satmask = (uint8_t*) command_alloc(nbAct);
+    if (buf->dminputs == NULL || buf->satmask == NULL)
+    {
+        printf("Could not allocate command buffers for %d actuators\n", nbAct);
+        return -1;
+    }
+    buf->command = buf->dminputs;
+    return 0;
+}
+
+void free_command_buffers(commandBuffers * buf)
+{
+    free(buf->dminputs);
+    free(buf->satmask);
+    buf->dminputs = NULL;
+    buf->satmask = NULL;
+}
+
+/* Session-constant settings for converting shared memory inputs to
+fractional stroke */
+typedef struct
+{
+    int nobias, nonorm, fractional;
+    Scalar max_stroke;
+    Scalar volume_factor;
+    int dtype;          // INPUT_* element type of the image
+    Scalar input_scale; // int16 inputs: units per count
+    int direct;         // input is already the command (--direct), nothing to convert
+    int gather;         // GATHER_INDEX or GATHER_PLAN (see gatherPlan)
+} conversionParams;
+
+/* Pixel of actuator idx. A NULL mapping means the input has already been
+put in actuator order (by a gather plan, or --vector), so kernels load it
+contiguously. */
+static inline __attribute__((always_inline))
+int gather_index(const int * actuator_mapping, int idx)
+{
+    return actuator_mapping == NULL ? idx : actuator_mapping[idx];
+}
+
+/* One input pixel as a double. dtype is a constant in every kernel this
+is inlined into, so the switch folds away. */
+static inline __attribute__((always_inline))
+Scalar load_input(const void * image, int dtype, int pixel, Scalar input_scale)
+{
+    switch (dtype)
+    {
+    case INPUT_DOUBLE:
+        return ((const double *) image)[pixel];
+    case INPUT_INT16:
+        return (Scalar)((const int16_t *) image)[pixel] * input_scale;
+    default:
+        return (Scalar)((const float *) image)[pixel];
+    }
+}
+
+/* Staged conversion exactly as sendCommand() used to do it: gather, then
+normalize, convert to fractional stroke, bias and clip one pass at a time.
+Kept as the reference the faster kernels are checked against. */
+int reference_convert(const void * image, const int * actuator_mapping,
+                      Scalar * dminputs, uint8_t * satmask, int nbAct,
+                      const conversionParams * conv)
+{
+    int idx;
+
+    // Cast to array type ALPAO expects
+    // Scalar = double
+    // Shared memory image = float, double or scaled int16
+    for ( idx = 0 ; idx < nbAct ; idx++ )
+    {
+        // use actuator mapping to pull correct element of shared memory image
+        dminputs[idx] = load_input(image, conv->dtype, gather_index(actuator_mapping, idx),
+                                   conv->input_scale);
+    }
+
+    // First, convert raw displacements to volume-normalized displacements (microns)
+    if (conv->nonorm != 1)
+    {
+        normalize_inputs(dminputs, nbAct, conv->volume_factor);
+    }
+
+    /* Second, convert from displacement (in microns) to fractional
+    stroke (-1 to +1) that the ALPAO SDK expects */
+    if (conv->fractional != 1)
+    {
+        microns_to_fractional_stroke(dminputs, nbAct, conv->max_stroke);
+    }
+    // Third, remove DC bias in inputs
+    if (conv->nobias != 1)
+    {
+        bias_inputs(dminputs, nbAct);
+    }
+
+    /* Fourth, clip to fractional values between -1 and 1.
+    The ALPAO SDK doesn't seem to check for this, which
+    is scary and a little odd. */
+    return clip_to_limits(dminputs, satmask, nbAct);
+}
+
+/* Body of the fused conversion, inlined into the generic and specialized
+kernels defined further down: gather, widen, normalize and convert to
+fractional stroke in a single pass, accumulating the mean as we go, then remove the
+bias and clip in a second pass (or clip in the first pass when biasing is
+disabled).
+
+The scale is applied as a multiply by volume_factor followed by a divide by
+max_stroke, in that order, rather than folded into one constant: folding
+changes the rounding and the output would no longer match
+reference_convert() bit for bit. */
+static inline __attribute__((always_inline))
+int fused_convert_body(const void * image, const int * actuator_mapping, Scalar * dminputs,
+                uint8_t * satmask, int nbAct, Scalar volume_factor, Scalar max_stroke,
+                int norm, int tostroke, int bias, int dtype, Scalar input_scale)
+{
+    int idx;
+    int nsat = 0;
+    Scalar val;
+    Scalar mean = 0;
+
+    for ( idx = 0 ; idx < nbAct ; idx++ )
+    {
+        val = load_input(image, dtype, gather_index(actuator_mapping, idx), input_scale);
+        if (norm)
+        {
+            val *= volume_factor;
+        }
+        if (tostroke)
+        {
+            val /= max_stroke;
+        }
+        if (bias)
+        {
+            // same summation order as bias_inputs()
+            mean += val;
+        } else if (val > 1)
+        {
+            nsat += mark_saturated(satmask, idx);
+            val = 1;
+        } else if (val < -1)
+        {
+            nsat += mark_saturated(satmask, idx);
+            val = -1;
+        }
+        dminputs[idx] = val;
+    }
+
+    if (!bias)
+    {
+        return nsat;
+    }
+
+    mean /= nbAct;
+    for ( idx = 0 ; idx < nbAct ; idx++ )
+    {
+        val = dminputs[idx] - mean;
+        if (val > 1)
+        {
+            nsat += mark_saturated(satmask, idx);
+            val = 1;
+        } else if (val < -1)
+        {
+            nsat += mark_saturated(satmask, idx);
+            val = -1;
+        }
+        dminputs[idx] = val;
+    }
+    return nsat;
+}
+
+#ifdef HAVE_X86_SIMD
+/* Vectorized versions of fused_convert_body(). Each does the same two passes
+with the gather, widening, scale and clamp done several actuators at a
+time and a scalar tail for the remainder. The clamp is written as
+max(-1, min(1, x)) with the limits as the first operand so a NaN input
+passes through unchanged, as it does in clip_to_limits(). The mean is
+accumulated per lane, so it can differ from the scalar sum in the last
+bit; verify_convert_kernel() checks the results against
+reference_convert() within a small tolerance. Float and double pixels
+are gathered with the AVX2/AVX-512 gather instructions; there is no
+16-bit gather, so int16 pixels are fetched one by one and widened and
+scaled as a vector. */
+
+static inline __attribute__((always_inline))
+void gather_int16(const void * image, const int * actuator_mapping, int idx, int32_t * raw, int n)
+{
+    int lane;
+
+    for ( lane = 0 ; lane < n ; lane++ )
+    {
+        raw[lane] = ((const int16_t *) image)[gather_index(actuator_mapping, idx + lane)];
+    }
+}
+
+static inline __attribute__((always_inline)) __attribute__((target("sse2")))
+int sse2_convert_body(const void * image, const int * actuator_mapping, Scalar * dminputs,
+                uint8_t * satmask, int nbAct, Scalar volume_factor, Scalar max_stroke,
+                int norm, int tostroke, int bias, int dtype, Scalar input_scale)
+{
+    int idx, lane, sat;
+    int nsat = 0;
+    __m128d vf = _mm_set1_pd(volume_factor);
+    __m128d ms = _mm_set1_pd(max_stroke);
+    __m128d one = _mm_set1_pd(1.0);
+    __m128d negone = _mm_set1_pd(-1.0);
+    __m128d vsum = _mm_setzero_pd();
+    __m128d val, mean;
+    Scalar tail, sums[2];
+
+    for ( idx = 0 ; idx + 2 <= nbAct ; idx += 2 )
+    {
+        // no gather instruction before AVX2
+        val = _mm_set_pd(load_input(image, dtype, gather_index(actuator_mapping, idx + 1), input_scale),
+                         load_input(image, dtype, gather_index(actuator_mapping, idx), input_scale));
+        if (norm)
+        {
+            val = _mm_mul_pd(val, vf);
+        }
+        if (tostroke)
+        {
+            val = _mm_div_pd(val, ms);
+        }
+        if (bias)
+        {
+            vsum = _mm_add_pd(vsum, val);
+        } else
+        {
+            sat = _mm_movemask_pd(_mm_or_pd(_mm_cmpgt_pd(val, one), _mm_cmplt_pd(val, negone)));
+            for ( lane = 0 ; sat ; lane++, sat >>= 1 )
+            {
+                if (sat & 1)
+                {
+                    nsat += mark_saturated(satmask, idx + lane);
+                }
+            }
+            val = _mm_max_pd(negone, _mm_min_pd(one, val));
+        }
+        _mm_storeu_pd(&dminputs[idx], val);
+    }
+    _mm_storeu_pd(sums, vsum);
+    tail = sums[0] + sums[1];
+    for ( ; idx < nbAct ; idx++ )
+    {
+        dminputs[idx] = load_input(image, dtype, gather_index(actuator_mapping, idx), input_scale);
+        if (norm)
+        {
+            dminputs[idx] *= volume_factor;
+        }
+        if (tostroke)
+        {
+            dminputs[idx] /= max_stroke;
+        }
+        tail += dminputs[idx];
+        if (!bias)
+        {
+            if (dminputs[idx] > 1)
+            {
+                nsat += mark_saturated(satmask, idx);
+                dminputs[idx] = 1;
+            } else if (dminputs[idx] < -1)
+            {
+                nsat += mark_saturated(satmask, idx);
+                dminputs[idx] = -1;
+            }
+        }
+    }
+
+    if (!bias)
+    {
+        return nsat;
+    }
+
+    mean = _mm_set1_pd(tail / nbAct);
+    for ( idx = 0 ; idx + 2 <= nbAct ; idx += 2 )
+    {
+        val = _mm_sub_pd(_mm_loadu_pd(&dminputs[idx]), mean);
+        sat = _mm_movemask_pd(_mm_or_pd(_mm_cmpgt_pd(val, one), _mm_cmplt_pd(val, negone)));
+        for ( lane = 0 ; sat ; lane++, sat >>= 1 )
+        {
+            if (sat & 1)
+            {
+                nsat += mark_saturated(satmask, idx + lane);
+            }
+        }
+        _mm_storeu_pd(&dminputs[idx], _mm_max_pd(negone, _mm_min_pd(one, val)));
+    }
+    for ( ; idx < nbAct ; idx++ )
+    {
+        dminputs[idx] -= tail / nbAct;
+        if (dminputs[idx] > 1)
+        {
+            nsat += mark_saturated(satmask, idx);
+            dminputs[idx] = 1;
+        } else if (dminputs[idx] < -1)
+        {
+            nsat += mark_saturated(satmask, idx);
+            dminputs[idx] = -1;
+        }
+    }
+    return nsat;
+}
+
+static inline __attribute__((always_inline)) __attribute__((target("avx2")))
+int avx2_convert_body(const void * image, const int * actuator_mapping, Scalar * dminputs,
+                uint8_t * satmask, int nbAct, Scalar volume_factor, Scalar max_stroke,
+                int norm, int tostroke, int bias, int dtype, Scalar input_scale)
+{
+    int idx, lane, sat;
+    int nsat = 0;
+    __m256d vf = _mm256_set1_pd(volume_factor);
+    __m256d ms = _mm256_set1_pd(max_stroke);
+    __m256d one = _mm256_set1_pd(1.0);
+    __m256d negone = _mm256_set1_pd(-1.0);
+    __m256d vsum = _mm256_setzero_pd();
+    __m256d val, mean;
+    __m256d vscale = _mm256_set1_pd(input_scale);
+    __m128i gidx;
+    int32_t raw[4];
+    Scalar tail, sums[4];
+
+    for ( idx = 0 ; idx + 4 <= nbAct ; idx += 4 )
+    {
+        // gather 4 pixels through the actuator mapping (or load them in order) and widen to double
+        if (dtype == INPUT_INT16)
+        {
+            gather_int16(image, actuator_mapping, idx, raw, 4);
+            val = _mm256_mul_pd(_mm256_cvtepi32_pd(_mm_loadu_si128((const __m128i *) raw)), vscale);
+        } else if (actuator_mapping == NULL)
+        {
+            val = dtype == INPUT_DOUBLE ? _mm256_loadu_pd((const double *) image + idx) :
+                  _mm256_cvtps_pd(_mm_loadu_ps((const float *) image + idx));
+        } else
+        {
+            gidx = _mm_loadu_si128((const __m128i *)&actuator_mapping[idx]);
+            val = dtype == INPUT_DOUBLE ? _mm256_i32gather_pd((const double *) image, gidx, 8) :
+                  _mm256_cvtps_pd(_mm_i32gather_ps((const float *) image, gidx, 4));
+        }
+        if (norm)
+        {
+            val = _mm256_mul_pd(val, vf);
+        }
+        if (tostroke)
+        {
+            val = _mm256_div_pd(val, ms);
+        }
+        if (bias)
+        {
+            vsum = _mm256_add_pd(vsum, val);
+        } else
+        {
+            sat = _mm256_movemask_pd(_mm256_or_pd(_mm256_cmp_pd(val, one, _CMP_GT_OQ),
+                                                  _mm256_cmp_pd(val, negone, _CMP_LT_OQ)));
+            for ( lane = 0 ; sat ; lane++, sat >>= 1 )
+            {
+                if (sat & 1)
+                {
+                    nsat += mark_saturated(satmask, idx + lane);
+                }
+            }
+            val = _mm256_max_pd(negone, _mm256_min_pd(one, val));
+        }
+        _mm256_storeu_pd(&dminputs[idx], val);
+    }
+    _mm256_storeu_pd(sums, vsum);
+    tail = (sums[0] + sums[1]) + (sums[2] + sums[3]);
+    for ( ; idx < nbAct ; idx++ )
+    {
+        dminputs[idx] = load_input(image, dtype, gather_index(actuator_mapping, idx), input_scale);
+        if (norm)
+        {
+            dminputs[idx] *= volume_factor;
+        }
+        if (tostroke)
+        {
+            dminputs[idx] /= max_stroke;
+        }
+        tail += dminputs[idx];
+        if (!bias)
+        {
+            if (dminputs[idx] > 1)
+            {
+                nsat += mark_saturated(satmask, idx);
+                dminputs[idx] = 1;
+            } else if (dminputs[idx] < -1)
+            {
+                nsat += mark_saturated(satmask, idx);
+                dminputs[idx] = -1;
+            }
+        }
+    }
+
+    if (!bias)
+    {
+        return nsat;
+    }
+
+    mean = _mm256_set1_pd(tail / nbAct);
+    for ( idx = 0 ; idx + 4 <= nbAct ; idx += 4 )
+    {
+        val = _mm256_sub_pd(_mm256_loadu_pd(&dminputs[idx]), mean);
+        sat = _mm256_movemask_pd(_mm256_or_pd(_mm256_cmp_pd(val, one, _CMP_GT_OQ),
+                                              _mm256_cmp_pd(val, negone, _CMP_LT_OQ)));
+        for ( lane = 0 ; sat ; lane++, sat >>= 1 )
+        {
+            if (sat & 1)
+            {
+                nsat += mark_saturated(satmask, idx + lane);
+            }
+        }
+        _mm256_storeu_pd(&dminputs[idx], _mm256_max_pd(negone, _mm256_min_pd(one, val)));
+    }
+    for ( ; idx < nbAct ; idx++ )
+    {
+        dminputs[idx] -= tail / nbAct;
+        if (dminputs[idx] > 1)
+        {
+            nsat += mark_saturated(satmask, idx);
+            dminputs[idx] = 1;
+        } else if (dminputs[idx] < -1)
+        {
+            nsat += mark_saturated(satmask, idx);
+            dminputs[idx] = -1;
+        }
+    }
+    return nsat;
+}
+
+static inline __attribute__((always_inline)) __attribute__((target("avx512f,avx2")))
+int avx512_convert_body(const void * image, const int * actuator_mapping, Scalar * dminputs,
+                uint8_t * satmask, int nbAct, Scalar volume_factor, Scalar max_stroke,
+                int norm, int tostroke, int bias, int dtype, Scalar input_scale)
+{
+    int idx, lane, sat;
+    int nsat = 0;
+    __m512d vf = _mm512_set1_pd(volume_factor);
+    __m512d ms = _mm512_set1_pd(max_stroke);
+    __m512d one = _mm512_set1_pd(1.0);
+    __m512d negone = _mm512_set1_pd(-1.0);
+    __m512d vsum = _mm512_setzero_pd();
+    __m512d val, mean;
+    __m512d vscale = _mm512_set1_pd(input_scale);
+    __m256i gidx; // 8 mapping indices, gathered with the AVX2 instruction
+    int32_t raw[8];
+    Scalar tail;
+
+    for ( idx = 0 ; idx + 8 <= nbAct ; idx += 8 )
+    {
+        // gather 8 pixels through the actuator mapping (or load them in order) and widen to double
+        if (dtype == INPUT_INT16)
+        {
+            gather_int16(image, actuator_mapping, idx, raw, 8);
+            val = _mm512_mul_pd(_mm512_cvtepi32_pd(_mm256_loadu_si256((const __m256i *) raw)), vscale);
+        } else if (actuator_mapping == NULL)
+        {
+            val = dtype == INPUT_DOUBLE ? _mm512_loadu_pd((const double *) image + idx) :
+                  _mm512_cvtps_pd(_mm256_loadu_ps((const float *) image + idx));
+        } else
+        {
+            gidx = _mm256_loadu_si256((const __m256i *)&actuator_mapping[idx]);
+            val = dtype == INPUT_DOUBLE ? _mm512_i32gather_pd(gidx, image, 8) :
+                  _mm512_cvtps_pd(_mm256_i32gather_ps((const float *) image, gidx, 4));
+        }
+        if (norm)
+        {
+            val = _mm512_mul_pd(val, vf);
+        }
+        if (tostroke)
+        {
+            val = _mm512_div_pd(val, ms);
+        }
+        if (bias)
+        {
+            vsum = _mm512_add_pd(vsum, val);
+        } else
+        {
+            sat = _mm512_cmp_pd_mask(val, one, _CMP_GT_OQ) | _mm512_cmp_pd_mask(val, negone, _CMP_LT_OQ);
+            for ( lane = 0 ; sat ; lane++, sat >>= 1 )
+            {
+                if (sat & 1)
+                {
+                    nsat += mark_saturated(satmask, idx + lane);
+                }
+            }
+            val = _mm512_max_pd(negone, _mm512_min_pd(one, val));
+        }
+        _mm512_storeu_pd(&dminputs[idx], val);
+    }
+    tail = _mm512_reduce_add_pd(vsum);
+    for ( ; idx < nbAct ; idx++ )
+    {
+        dminputs[idx] = load_input(image, dtype, gather_index(actuator_mapping, idx), input_scale);
+        if (norm)
+        {
+            dminputs[idx] *= volume_factor;
+        }
+        if (tostroke)
+        {
+            dminputs[idx] /= max_stroke;
+        }
+        tail += dminputs[idx];
+        if (!bias)
+        {
+            if (dminputs[idx] > 1)
+            {
+                nsat += mark_saturated(satmask, idx);
+                dminputs[idx] = 1;
+            } else if (dminputs[idx] < -1)
+            {
+                nsat += mark_saturated(satmask, idx);
+                dminputs[idx] = -1;
+            }
+        }
+    }
+
+    if (!bias)
+    {
+        return nsat;
+    }
+
+    mean = _mm512_set1_pd(tail / nbAct);
+    for ( idx = 0 ; idx + 8 <= nbAct ; idx += 8 )
+    {
+        val = _mm512_sub_pd(_mm512_loadu_pd(&dminputs[idx]), mean);
+        sat = _mm512_cmp_pd_mask(val, one, _CMP_GT_OQ) | _mm512_cmp_pd_mask(val, negone, _CMP_LT_OQ);
+        for ( lane = 0 ; sat ; lane++, sat >>= 1 )
+        {
+            if (sat & 1)
+            {
+                nsat += mark_saturated(satmask, idx + lane);
+            }
+        }
+        _mm512_storeu_pd(&dminputs[idx], _mm512_max_pd(negone, _mm512_min_pd(one, val)));
+    }
+    for ( ; idx < nbAct ; idx++ )
+    {
+        dminputs[idx] -= tail / nbAct;
+        if (dminputs[idx] > 1)
+        {
+            nsat += mark_saturated(satmask, idx);
+            dminputs[idx] = 1;
+        } else if (dminputs[idx] < -1)
+        {
+            nsat += mark_saturated(satmask, idx);
+            dminputs[idx] = -1;
+        }
+    }
+    return nsat;
+}
+#endif
+
+/* Conversion kernel: fills dminputs from the shared memory image (through
+actuator_mapping, or in order if it is NULL), sets satmask[idx] for every
+actuator it clips (it never clears entries) and returns the number
+clipped. */
+typedef int (*convertKernel)(const void * image, const int * actuator_mapping,
+                             Scalar * dminputs, uint8_t * satmask, int nbAct,
+                             const conversionParams * conv);
+
+/* Index of a nobias/nonorm/fractional combination in the specialized
+kernel tables */
+int conversion_flags(const conversionParams * conv)
+{
+    return (conv->nobias == 1) | (conv->nonorm == 1) << 1 | (conv->fractional == 1) << 2;
+}
+
+/* Generic kernels: flags and actuator count are read at run time, and
+the input type selects one of three inlined copies of the body. */
+#define GENERIC_CONVERT_CASE(isa, dtype) \
+    case dtype: \
+        return isa##_convert_body(image, actuator_mapping, dminputs, satmask, nbAct, \
+                           conv->volume_factor, conv->max_stroke, \
+                           conv->nonorm != 1, conv->fractional != 1, conv->nobias != 1, \
+                           dtype, conv->input_scale);
+
+#define DEFINE_GENERIC_CONVERT(isa, attr) \
+    attr int isa##_convert(const void * image, const int * actuator_mapping, \
+                           Scalar * dminputs, uint8_t * satmask, int nbAct, \
+                           const conversionParams * conv) \
+    { \
+        switch (conv->dtype) \
+        { \
+        GENERIC_CONVERT_CASE(isa, INPUT_DOUBLE) \
+        GENERIC_CONVERT_CASE(isa, INPUT_INT16) \
+        default: \
+        GENERIC_CONVERT_CASE(isa, INPUT_FLOAT) \
+        } \
+    }
+
+/* Specialized kernels: the input type, the flags, and for the known ALPAO
+models the actuator count, are compile-time constants, so the inlined
+body has no type or flag branches and fixed trip counts; a fixed-model
+kernel asserts it was picked for the caller's actuator count. Named
+<isa>_convert_<type>_<model>_<nobias><nonorm><fractional>. */
+#define DEFINE_CONVERT(isa, attr, type, dtype, model, nact, nobias, nonorm, fractional) \
+    static attr int isa##_convert_##type##_##model##_##nobias##nonorm##fractional( \
+        const void * image, const int * actuator_mapping, Scalar * dminputs, \
+        uint8_t * satmask, int nbAct, const conversionParams * conv) \
+    { \
+        assert(nbAct == nact); \
+        (void) nbAct; \
+        return isa##_convert_body(image, actuator_mapping, dminputs, satmask, nact, \
+                           conv->volume_factor, conv->max_stroke, \
+                           !nonorm, !fractional, !nobias, dtype, conv->input_scale); \
+    }
+
+#define DEFINE_CONVERT_FLAGS(isa, attr, type, dtype, model, nact) \
+    DEFINE_CONVERT(isa, attr, type, dtype, model, nact, 0, 0, 0) \
+    DEFINE_CONVERT(isa, attr, type, dtype, model, nact, 1, 0, 0) \
+    DEFINE_CONVERT(isa, attr, type, dtype, model, nact, 0, 1, 0) \
+    DEFINE_CONVERT(isa, attr, type, dtype, model, nact, 1, 1, 0) \
+    DEFINE_CONVERT(isa, attr, type, dtype, model, nact, 0, 0, 1) \
+    DEFINE_CONVERT(isa, attr, type, dtype, model, nact, 1, 0, 1) \
+    DEFINE_CONVERT(isa, attr, type, dtype, model, nact, 0, 1, 1) \
+    DEFINE_CONVERT(isa, attr, type, dtype, model, nact, 1, 1, 1)
+
+// ordered by conversion_flags()
+#define CONVERT_FLAGS_ROW(isa, type, model) \
+    { isa##_convert_##type##_##model##_000, isa##_convert_##type##_##model##_100, \
+      isa##_convert_##type##_##model##_010, isa##_convert_##type##_##model##_110, \
+      isa##_convert_##type##_##model##_001, isa##_convert_##type##_##model##_101, \
+      isa##_convert_##type##_##model##_011, isa##_convert_##type##_##model##_111 }
+
+// actuator counts of the ALPAO models we specialize for
+static const int specialized_models[] = {97, 277, 292, 820, 3228};
+#define N_SPECIALIZED_MODELS 5
+
+/* [model][flags] table for one input type. The last row fixes only the
+flags and takes nbAct at run time. */
+#define DEFINE_CONVERT_TYPE(isa, attr, type, dtype) \
+    DEFINE_CONVERT_FLAGS(isa, attr, type, dtype, 97, 97) \
+    DEFINE_CONVERT_FLAGS(isa, attr, type, dtype, 277, 277) \
+    DEFINE_CONVERT_FLAGS(isa, attr, type, dtype, 292, 292) \
+    DEFINE_CONVERT_FLAGS(isa, attr, type, dtype, 820, 820) \
+    DEFINE_CONVERT_FLAGS(isa, attr, type, dtype, 3228, 3228) \
+    DEFINE_CONVERT_FLAGS(isa, attr, type, dtype, any, nbAct)
+
+#define CONVERT_TYPE_TABLE(isa, type) \
+    { CONVERT_FLAGS_ROW(isa, type, 97), \
+      CONVERT_FLAGS_ROW(isa, type, 277), \
+      CONVERT_FLAGS_ROW(isa, type, 292), \
+      CONVERT_FLAGS_ROW(isa, type, 820), \
+      CONVERT_FLAGS_ROW(isa, type, 3228), \
+      CONVERT_FLAGS_ROW(isa, type, any) }
+
+/* Generic kernel plus a [type][model][flags] table of specialized ones,
+types ordered as INPUT_* */
+#define DEFINE_CONVERT_KERNELS(isa, attr) \
+    DEFINE_GENERIC_CONVERT(isa, attr) \
+    DEFINE_CONVERT_TYPE(isa, attr, float, INPUT_FLOAT) \
+    DEFINE_CONVERT_TYPE(isa, attr, double, INPUT_DOUBLE) \
+    DEFINE_CONVERT_TYPE(isa, attr, int16, INPUT_INT16) \
+    static const convertKernel isa##_specialized[N_INPUT_TYPES][N_SPECIALIZED_MODELS + 1][8] = { \
+        CONVERT_TYPE_TABLE(isa, float), \
+        CONVERT_TYPE_TABLE(isa, double), \
+        CONVERT_TYPE_TABLE(isa, int16) };
+
+DEFINE_CONVERT_KERNELS(fused, )
+#ifdef HAVE_X86_SIMD
+DEFINE_CONVERT_KERNELS(sse2, __attribute__((target("sse2"))))
+DEFINE_CONVERT_KERNELS(avx2, __attribute__((target("avx2"))))
+DEFINE_CONVERT_KERNELS(avx512, __attribute__((target("avx512f,avx2"))))
+#endif
+
+/* Conversion kernels, fastest first. select_convert_kernel() takes the
+first one the host CPU supports. */
+typedef struct
+{
+    const char * name;
+    const char * cpu_feature; // __builtin_cpu_supports() name, NULL if always available
+    convertKernel kernel;
+    const convertKernel (*specialized)[N_SPECIALIZED_MODELS + 1][8];
+} kernelEntry;
+
+static const kernelEntry convert_kernels[] = {
+#ifdef HAVE_X86_SIMD
+    {"avx512", "avx512f", avx512_convert, avx512_specialized},
+    {"avx2",   "avx2",    avx2_convert,   avx2_specialized},
+    {"sse2",   "sse2",    sse2_convert,   sse2_specialized},
+#endif
+    {"scalar", NULL,      fused_convert,  fused_specialized},
+};
+#define N_CONVERT_KERNELS (int)(sizeof(convert_kernels) / sizeof(convert_kernels[0]))
+
+int cpu_feature_supported(const char * cpu_feature)
+{
+    if (cpu_feature == NULL)
+    {
+        return 1;
+    }
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (strcmp(cpu_feature, "avx512f") == 0) return __builtin_cpu_supports("avx512f");
+    if (strcmp(cpu_feature, "avx2") == 0) return __builtin_cpu_supports("avx2");
+    if (strcmp(cpu_feature, "sse2") == 0) return __builtin_cpu_supports("sse2");
+#endif
+    return 0;
+}
+
+int kernel_supported(const kernelEntry * entry)
+{
+    return cpu_feature_supported(entry->cpu_feature);
+}
+
+/* Compare a kernel against reference_convert() on synthetic inputs of
+the session's type, including saturating ones, for every flag
+combination (all_flags = 1) or only the one in conv (for specialized
+kernels). Each case is run both through the gather index and on the
+same pixels already in actuator order (a NULL mapping, as after a gather
+plan). Returns 0 if all outputs agree to within a few ulp of the
+fractional stroke range. */
+int verify_convert_kernel(convertKernel kernel, const conversionParams * conv, int nbAct,
+                          int all_flags)
+{
+    int npix = 4 * nbAct;
+    int idx, flags, trial, pass;
+    int result = 0;
+    size_t size = input_types[conv->dtype].size;
+    void * image;
+    void * gathered;
+    int * mapping;
+    Scalar * expected;
+    Scalar * actual;
+    uint8_t * expected_mask;
+    uint8_t * actual_mask;
+    conversionParams test;
+    unsigned int seed = 12345;
+    float val;
+
+    image = malloc(npix * size);
+    gathered = malloc(nbAct * size);
+    mapping = (int *) malloc(nbAct * sizeof(int));
+    expected = (Scalar *) malloc(nbAct * sizeof(Scalar));
+    actual = (Scalar *) malloc(nbAct * sizeof(Scalar));
+    expected_mask = (uint8_t *) malloc(nbAct);
+    actual_mask = (uint8_t *) malloc(nbAct);
+    if (image == NULL || gathered == NULL || mapping == NULL || expected == NULL || actual == NULL ||
+        expected_mask == NULL || actual_mask == NULL)
+    {
+        printf("Memory allocation error\n");
+        result = -1;
+        goto cleanup;
+    }
+
+    // scattered mapping, like a real actuator map
+    for ( idx = 0 ; idx < nbAct ; idx++ )
+    {
+        mapping[idx] = (int)(((long)idx * 37) % npix);
+    }
+
+    for ( trial = 0 ; trial < 4 && result == 0 ; trial++ )
+    {
+        // later trials push more actuators past the limits
+        for ( idx = 0 ; idx < npix ; idx++ )
+        {
+            val = ((float)rand_r(&seed) / RAND_MAX - 0.5f) * (float)(1 << trial) * conv->max_stroke;
+            switch (conv->dtype)
+            {
+            case INPUT_DOUBLE:
+                ((double *) image)[idx] = val;
+                break;
+            case INPUT_INT16:
+                // the full int16 range, whatever the scale
+                ((int16_t *) image)[idx] = (int16_t)(val / ((1 << trial) * conv->max_stroke) * 65534);
+                break;
+            default:
+                ((float *) image)[idx] = val;
+            }
+        }
+        for ( idx = 0 ; idx < nbAct ; idx++ )
+        {
+            memcpy((char *) gathered + idx * size, (const char *) image + mapping[idx] * size, size);
+        }
+        for ( flags = 0 ; flags < 16 ; flags++ )
+        {
+            // bit 3 selects the pass in actuator order
+            pass = flags >> 3;
+            if (!all_flags && (flags & 7) != conversion_flags(conv))
+            {
+                continue;
+            }
+            test = *conv;
+            test.nobias = flags & 1;
+            test.nonorm = (flags >> 1) & 1;
+            test.fractional = (flags >> 2) & 1;
+            memset(expected_mask, 0, nbAct);
+            memset(actual_mask, 0, nbAct);
+            reference_convert(image, mapping, expected, expected_mask, nbAct, &test);
+            if (pass)
+            {
+                kernel(gathered, NULL, actual, actual_mask, nbAct, &test);
+            } else
+            {
+                kernel(image, mapping, actual, actual_mask, nbAct, &test);
+            }
+            for ( idx = 0 ; idx < nbAct ; idx++ )
+            {
+                if (fabs(expected[idx] - actual[idx]) > 1e-12 * (1 + fabs(expected[idx])))
+                {
+                    result = -1;
+                }
+                // values within rounding of the limit may legitimately clip in only one
+                if (expected_mask[idx] != actual_mask[idx] && fabs(fabs(expected[idx]) - 1) > 1e-9)
+                {
+                    result = -1;
+                }
+            }
+        }
+    }
+
+cleanup:
+    free(image);
+    free(gathered);
+    free(mapping);
+    free(expected);
+    free(actual);
+    free(expected_mask);
+    free(actual_mask);
+    return result;
+}
+
+/* Choose the conversion kernel for this host. With requested == NULL (or
+"auto") the fastest kernel the CPU supports that also passes
+verify_convert_kernel() is used, falling back to the scalar kernel. The
+returned kernel is the instance specialized for the session's flags (and
+actuator count, for the known models), so the control loop calls a single
+function pointer with no per-frame flag checks. */
+convertKernel select_convert_kernel(const char * serial, const char * requested,
+                                    const conversionParams * conv, int nbAct)
+{
+    int i, model;
+    int automatic = (requested == NULL || strcmp(requested, "auto") == 0);
+    const kernelEntry * entry = NULL;
+    convertKernel kernel;
+
+    for ( i = 0 ; i < N_CONVERT_KERNELS ; i++ )
+    {
+        if (!automatic && strcmp(requested, convert_kernels[i].name) != 0)
+        {
+            continue;
+        }
+        if (!kernel_supported(&convert_kernels[i]))
+        {
+            if (!automatic)
+            {
+                printf("ALPAO %s: %s kernel not supported by this CPU.\n", serial, requested);
+            }
+            continue;
+        }
+        if (verify_convert_kernel(convert_kernels[i].kernel, conv, nbAct, 1) != 0)
+        {
+            printf("ALPAO %s: %s kernel does not match the reference conversion; skipping.\n",
+                   serial, convert_kernels[i].name);
+            continue;
+        }
+        entry = &convert_kernels[i];
+        break;
+    }
+    if (entry == NULL)
+    {
+        // scalar kernel is always last
+        entry = &convert_kernels[N_CONVERT_KERNELS - 1];
+    }
+
+    // last row of the table is for any actuator count
+    for ( model = 0 ; model < N_SPECIALIZED_MODELS ; model++ )
+    {
+        if (specialized_models[model] == nbAct)
+        {
+            break;
+        }
+    }
+    kernel = entry->specialized[conv->dtype][model][conversion_flags(conv)];
+    if (verify_convert_kernel(kernel, conv, nbAct, 0) != 0)
+    {
+        printf("ALPAO %s: specialized %s kernel does not match the reference conversion.\n",
+               serial, entry->name);
+        kernel = entry->kernel;
+    }
+
+    if (model < N_SPECIALIZED_MODELS)
+    {
+        printf("ALPAO %s: using %s %s conversion kernel specialized for %d actuators.\n",
+               serial, entry->name, input_types[conv->dtype].name, nbAct);
+    } else
+    {
+        printf("ALPAO %s: using %s %s conversion kernel.\n", serial, entry->name,
+               input_types[conv->dtype].name);
+    }
+    return kernel;
+}
+
+/* Gather plan. The actuator map is read row by row, so actuators that
+sit side by side in a row of the pupil are consecutive in the gather
+index and read consecutive pixels. compile_gather_plan() turns every run
+of at least GATHER_MIN_RUN such actuators into one block copy into a
+staging buffer in actuator order; the scattered actuators left over are
+copied one by one. The conversion kernel then reads the staging buffer
+in order (a NULL mapping) instead of gathering through the index.
+Whether the copy beats the kernel's own indexed loads depends on the map
+and the CPU, so with --gather=auto choose_gather() times both on the
+live image at startup and keeps the faster. */
+#define GATHER_MIN_RUN 4
+#define GATHER_BENCH_FRAMES 2000
+#define GATHER_BENCH_ROUNDS 5
+
+enum { GATHER_AUTO = -1, GATHER_INDEX, GATHER_PLAN };
+
+static const char * gather_names[] = {"index", "plan"};
+
+typedef struct
+{
+    int act;   // first actuator
+    int pix;   // its pixel; the run continues on consecutive pixels
+    int len;
+} gatherRun;
+
+typedef struct
+{
+    gatherRun * runs;
+    int nruns;
+    int * singles_act;       // actuators outside any run
+    int * singles_pix;
+    int nsingles;
+    int identity;            // the index is 0..nbAct-1: nothing to copy
+    size_t elemsize;         // bytes per input pixel
+    void * staging;          // nbAct inputs in actuator order
+} gatherPlan;
+
+// what the loop converts with; swapped as a whole
+typedef struct
+{
+    conversionParams conv;
+    int * mapping;            // gather index, nbAct entries
+    gatherPlan plan;          // the same index as block copies
+    struct modalProduct * modal; // --modal: expand coefficients first (owned by the loop)
+} calibrationSet;
+
+int compile_gather_plan(gatherPlan * plan, const int * mapping, int nbAct, size_t elemsize)
+{
+    int idx, end;
+
+    memset(plan, 0, sizeof(gatherPlan));
+    plan->elemsize = elemsize;
+    plan->runs = (gatherRun *) malloc(nbAct * sizeof(gatherRun));
+    plan->singles_act = (int *) malloc(nbAct * sizeof(int));
+    plan->singles_pix = (int *) malloc(nbAct * sizeof(int));
+    if (plan->runs == NULL || plan->singles_act == NULL || plan->singles_pix == NULL ||
+        posix_memalign(&plan->staging, CACHE_LINE, nbAct * elemsize) != 0)
+    {
+        free(plan->runs);
+        free(plan->singles_act);
+        free(plan->singles_pix);
+        return -1;
+    }
+
+    for ( idx = 0 ; idx < nbAct ; idx = end )
+    {
+        for ( end = idx + 1 ; end < nbAct && mapping[end] == mapping[end - 1] + 1 ; end++ )
+        {
+        }
+        if (end - idx >= GATHER_MIN_RUN)
+        {
+            plan->runs[plan->nruns].act = idx;
+            plan->runs[plan->nruns].pix = mapping[idx];
+            plan->runs[plan->nruns].len = end - idx;
+            plan->nruns++;
+        } else
+        {
+            for ( ; idx < end ; idx++ )
+            {
+                plan->singles_act[plan->nsingles] = idx;
+                plan->singles_pix[plan->nsingles] = mapping[idx];
+                plan->nsingles++;
+            }
+        }
+    }
+    plan->identity = (plan->nruns == 1 && plan->runs[0].pix == 0 && plan->runs[0].len == nbAct);
+    return 0;
+}
+
+void free_gather_plan(gatherPlan * plan)
+{
+    free(plan->runs);
+    free(plan->singles_act);
+    free(plan->singles_pix);
+    free(plan->staging);
+}
+
+/* Put the image's actuator pixels in actuator order; returns what the
+kernel should read with a NULL mapping */
+static inline const void * plan_gather(const gatherPlan * plan, const void * image)
+{
+    const char * src = (const char *) image;
+    char * dst = (char *) plan->staging;
+    size_t size = plan->elemsize;
+    int n;
+
+    if (plan->identity)
+    {
+        return image;
+    }
+    for ( n = 0 ; n < plan->nruns ; n++ )
+    {
+        memcpy(dst + plan->runs[n].act * size, src + plan->runs[n].pix * size,
+               plan->runs[n].len * size);
+    }
+    switch (size)
+    {
+    case 2:
+        for ( n = 0 ; n < plan->nsingles ; n++ )
+        {
+            ((uint16_t *) dst)[plan->singles_act[n]] = ((const uint16_t *) src)[plan->singles_pix[n]];
+        }
+        break;
+    case 8:
+        for ( n = 0 ; n < plan->nsingles ; n++ )
+        {
+            ((uint64_t *) dst)[plan->singles_act[n]] = ((const uint64_t *) src)[plan->singles_pix[n]];
+        }
+        break;
+    default:
+        for ( n = 0 ; n < plan->nsingles ; n++ )
+        {
+            ((uint32_t *) dst)[plan->singles_act[n]] = ((const uint32_t *) src)[plan->singles_pix[n]];
+        }
+    }
+    return plan->staging;
+}
+
+/* A calibration must drive every actuator of the DM from its own entry
+of the map, and every entry must be a pixel of the input image; the
+scales must be usable divisors unless the flags skip them. With vector
+= 1 the map is not used. */
+int check_calibration(const char * serial, const calibration * cal, int nbAct, const int * axes,
+                      int vector, const conversionParams * flags)
+{
+    int idx;
+    size_t npix = (size_t) axes[0] * axes[1];
+
+    if (!vector)
+    {
+        if (cal->map_size[0] != axes[0] || cal->map_size[1] != axes[1])
+        {
+            printf("ALPAO %s: actuator mapping is %dx%d, the input image %dx%d\n", serial,
+                   cal->map_size[0], cal->map_size[1], axes[0], axes[1]);
+            return -1;
+        }
+        if (cal->nmap != nbAct)
+        {
+            printf("ALPAO %s: actuator mapping has %d actuators, the DM %d\n",
+                   serial, cal->nmap, nbAct);
+            return -1;
+        }
+        for ( idx = 0 ; idx < nbAct ; idx++ )
+        {
+            if (cal->mapping[idx] < 0 || (size_t) cal->mapping[idx] >= npix)
+            {
+                printf("ALPAO %s: actuator mapping points outside the %zu pixel input\n",
+                       serial, npix);
+                return -1;
+            }
+        }
+    }
+    if ((flags->fractional != 1 && !(isfinite(cal->max_stroke) && cal->max_stroke != 0)) ||
+        (flags->nonorm != 1 && !(isfinite(cal->volume_factor) && cal->volume_factor != 0)))
+    {
+        printf("ALPAO %s: max_stroke %g or volume_factor %g is not usable\n",
+               serial, cal->max_stroke, cal->volume_factor);
+        return -1;
+    }
+    return 0;
+}
+
+/* Build the set the loop uses from a checked calibration. With vector = 1
+the input is already in actuator order and the gather index is the
+identity. */
+calibrationSet * new_calibration_set(const conversionParams * flags, const calibration * cal, int nbAct,
+                                     int vector)
+{
+    int idx;
+
+    calibrationSet * set;
+
+    set = (calibrationSet *) malloc(sizeof(calibrationSet));
+    if (set == NULL)
+    {
+        return NULL;
+    }
+    set->conv = *flags;
+    set->conv.max_stroke = cal->max_stroke;
+    set->conv.volume_factor = cal->volume_factor;
+    set->modal = NULL;
+    if (posix_memalign((void **) &set->mapping, CACHE_LINE, nbAct * sizeof(int)) != 0)
+    {
+        free(set);
+        return NULL;
+    }
+    for ( idx = 0 ; idx < nbAct ; idx++ )
+    {
+        set->mapping[idx] = vector ? idx : cal->mapping[idx];
+    }
+    if (compile_gather_plan(&set->plan, set->mapping, nbAct, input_types[flags->dtype].size) == -1)
+    {
+        free(set->mapping);
+        free(set);
+        return NULL;
+    }
+    return set;
+}
+
+void free_calibration_set(calibrationSet * set)
+{
+    if (set != NULL)
+    {
+        free_gather_plan(&set->plan);
+        free(set->mapping);
+        free(set);
+    }
+}
+
+static int64_t time_gather(convertKernel convert, const calibrationSet * set, int mode,
+                           const void * image, Scalar * dminputs, uint8_t * satmask, int nbAct)
+{
+    struct timespec start, end;
+    int n;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for ( n = 0 ; n < GATHER_BENCH_FRAMES ; n++ )
+    {
+        if (mode == GATHER_PLAN)
+        {
+            convert(plan_gather(&set->plan, image), NULL, dminputs, satmask, nbAct, &set->conv);
+        } else
+        {
+            convert(image, set->mapping, dminputs, satmask, nbAct, &set->conv);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (int64_t)(end.tv_sec - start.tv_sec) * 1000000000 + (end.tv_nsec - start.tv_nsec);
+}
+
+/* Report the plan and decide how the loop gathers: as requested, or with
+GATHER_AUTO whichever converts the live image faster (best of a few
+interleaved rounds, so a stray interrupt doesn't decide it) */
+int choose_gather(const char * serial, int requested, convertKernel convert,
+                  const calibrationSet * set, const void * image, int nbAct)
+{
+    int64_t best[2] = {INT64_MAX, INT64_MAX};
+    int64_t t;
+    int round, mode;
+    Scalar * dminputs;
+    uint8_t * satmask;
+    int chosen = requested;
+
+    printf("ALPAO %s: gather plan has %d runs of consecutive pixels and %d single actuators%s.\n",
+           serial, set->plan.nruns, set->plan.nsingles,
+           set->plan.identity ? " (already in actuator order)" : "");
+    if (requested != GATHER_AUTO)
+    {
+        printf("ALPAO %s: gathering with the %s.\n", serial, gather_names[requested]);
+        return requested;
+    }
+
+    dminputs = (Scalar *) malloc(nbAct * sizeof(Scalar));
+    satmask = (uint8_t *) calloc(nbAct, 1);
+    if (dminputs == NULL || satmask == NULL)
+    {
+        free(dminputs);
+        free(satmask);
+        return GATHER_INDEX;
+    }
+    for ( round = 0 ; round < GATHER_BENCH_ROUNDS ; round++ )
+    {
+        for ( mode = GATHER_INDEX ; mode <= GATHER_PLAN ; mode++ )
+        {
+            t = time_gather(convert, set, mode, image, dminputs, satmask, nbAct);
+            best[mode] = t < best[mode] ? t : best[mode];
+        }
+    }
+    free(dminputs);
+    free(satmask);
+
+    chosen = best[GATHER_PLAN] < best[GATHER_INDEX] ? GATHER_PLAN : GATHER_INDEX;
+    printf("ALPAO %s: conversion takes %.0f ns with the gather plan, %.0f ns with the index; "
+           "using the %s.\n", serial, (double) best[GATHER_PLAN] / GATHER_BENCH_FRAMES,
+           (double) best[GATHER_INDEX] / GATHER_BENCH_FRAMES, gather_names[chosen]);
+    return chosen;
+}
+
+/* Saturation accounting. The kernels only flag clipped actuators in the
+command buffer's mask; counting, publishing and logging happen here after
+the command has gone out, and the log is a single aggregate line at most
+once per log_interval rather than a message per actuator per frame. */
+typedef struct
+{
+    unsigned long * counts; // frames each actuator has been clipped this session
+    unsigned long frames;   // frames with any clipping since the last log message
+    unsigned long clips;    // actuator clips since the last log message
+    double log_interval;    // minimum seconds between log messages
+    struct timespec lastlog;
+    IMAGE * stream;         // <shm_name>_sat: row 0 frame mask, row 1 counts
+} saturationStats;
+
+/* Create the <shm_name>_sat stream: a nbAct x 2 uint32 image whose first
+row is the saturation mask of the last frame sent and whose second row is
+the number of frames each actuator has been clipped. It posts once per
+DM command. */
+IMAGE * initializeSaturationStream(const char * shm_name, int nbAct)
+{
+    char sat_name[MAX_STRLEN];
+    uint32_t imsize[2];
+    IMAGE * SMimage;
+
+    snprintf(sat_name, MAX_STRLEN, "%s_sat", shm_name);
+    imsize[0] = nbAct;
+    imsize[1] = 2;
+
+    SMimage = (IMAGE*) malloc(sizeof(IMAGE));
+    if (SMimage == NULL)
+    {
+        return NULL;
+    }
+    ImageStreamIO_createIm(&SMimage[0], sat_name, 2, imsize, _DATATYPE_UINT32, 1, 0, 0);
+    memset(SMimage[0].array.UI32, 0, 2 * nbAct * sizeof(uint32_t));
+    return SMimage;
+}
+
+int init_saturation_stats(saturationStats * sat, const char * shm_name, int nbAct,
+                          double log_interval)
+{
+    sat->counts = (unsigned long *) calloc(nbAct, sizeof(unsigned long));
+    sat->frames = 0;
+    sat->clips = 0;
+    sat->log_interval = log_interval;
+    clock_gettime(CLOCK_MONOTONIC, &sat->lastlog);
+    sat->stream = initializeSaturationStream(shm_name, nbAct);
+    if (sat->counts == NULL || sat->stream == NULL)
+    {
+        printf("Could not set up saturation tracking\n");
+        free(sat->counts);
+        sat->counts = NULL;
+        if (sat->stream != NULL)
+        {
+            ImageStreamIO_closeIm(&sat->stream[0]);
+            free(sat->stream);
+            sat->stream = NULL;
+        }
+        return -1;
+    }
+    return 0;
+}
+
+/* Print one aggregate line for the saturations since the last message */
+void log_saturation(saturationStats * sat, const char * serial, int nbAct, double elapsed)
+{
+    int idx;
+    int worst = 0;
+
+    for ( idx = 1 ; idx < nbAct ; idx++ )
+    {
+        if (sat->counts[idx] > sat->counts[worst])
+        {
+            worst = idx;
+        }
+    }
+    printf("ALPAO %s: %lu actuator clips in %lu frames over the last %.1f s "
+           "(most clipped: actuator %d, %lu frames this session)\n",
+           serial, sat->clips, sat->frames, elapsed, worst + 1, sat->counts[worst]);
+    sat->frames = 0;
+    sat->clips = 0;
+}
+
+/* Count, publish and (rate-limited) log the saturations of the frame just
+sent. lastsat is the number of actuators clipped in the frame before, so
+the published mask is only rewritten when it actually changes. */
+void record_saturation(saturationStats * sat, const commandBuffers * buf, int lastsat,
+                       const char * serial)
+{
+    int idx;
+    int nbAct = buf->nbAct;
+    struct timespec now;
+    double elapsed;
+    uint32_t * row;
+
+    if (buf->nsat > 0)
+    {
+        for ( idx = 0 ; idx < nbAct ; idx++ )
+        {
+            sat->counts[idx] += buf->satmask[idx];
+        }
+        sat->frames++;
+        sat->clips += buf->nsat;
+    }
+
+    if (sat->stream != NULL)
+    {
+        row = sat->stream[0].array.UI32;
+        sat->stream[0].md[0].write = 1;
+        if (buf->nsat > 0 || lastsat > 0)
+        {
+            for ( idx = 0 ; idx < nbAct ; idx++ )
+            {
+                row[idx] = buf->satmask[idx];
+                row[nbAct + idx] = (uint32_t) sat->counts[idx];
+            }
+        }
+        sat->stream[0].md[0].cnt0++;
+        sat->stream[0].md[0].cnt1++;
+        clock_gettime(CLOCK_REALTIME, &sat->stream[0].md[0].writetime);
+        sat->stream[0].md[0].write = 0;
+        ImageStreamIO_sempost(&sat->stream[0], -1);
+    }
+
+    if (sat->frames > 0)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        elapsed = (now.tv_sec - sat->lastlog.tv_sec) + 1e-9 * (now.tv_nsec - sat->lastlog.tv_nsec);
+        if (elapsed >= sat->log_interval)
+        {
+            log_saturation(sat, serial, nbAct, elapsed);
+            sat->lastlog = now;
+        }
+    }
+}
+
+void free_saturation_stats(saturationStats * sat, const char * serial, int nbAct)
+{
+    struct timespec now;
+
+    // report anything still pending from the last interval
+    if (sat->frames > 0)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        log_saturation(sat, serial, nbAct,
+                       (now.tv_sec - sat->lastlog.tv_sec) + 1e-9 * (now.tv_nsec - sat->lastlog.tv_nsec));
+    }
+    free(sat->counts);
+    sat->counts = NULL;
+    ImageStreamIO_closeIm(&sat->stream[0]);
+    free(sat->stream);
+    sat->stream = NULL;
+}
+
+/* Latency histograms. Values are in nanoseconds and binned HDR-style:
+exact below 2^HIST_SUB_BITS, then 2^HIST_SUB_BITS linear sub-buckets per
+power of two, which bounds the relative error of any reported value to
+about 3% with a fixed, preallocated table. Recording is a couple of
+shifts and an increment. */
+#define HIST_SUB_BITS 5
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_MAX_EXP 36 // buckets up to 2^37 ns, about two minutes; anything longer lands in the last one
+#define HIST_BUCKETS ((HIST_MAX_EXP - HIST_SUB_BITS + 2) * HIST_SUB_COUNT)
+
+typedef struct
+{
+    const char * name;
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+} latencyHistogram;
+
+static inline int histogram_bucket(uint64_t value)
+{
+    int exponent;
+
+    if (value < HIST_SUB_COUNT)
+    {
+        return (int) value;
+    }
+    exponent = 63 - __builtin_clzll(value);
+    if (exponent > HIST_MAX_EXP)
+    {
+        return HIST_BUCKETS - 1;
+    }
+    return (exponent - HIST_SUB_BITS + 1) * HIST_SUB_COUNT
+           + (int)((value >> (exponent - HIST_SUB_BITS)) & (HIST_SUB_COUNT - 1));
+}
+
+// largest value that falls in a bucket
+uint64_t histogram_bucket_max(int bucket)
+{
+    int exponent;
+
+    if (bucket < HIST_SUB_COUNT)
+    {
+        return bucket;
+    }
+    exponent = bucket / HIST_SUB_COUNT + HIST_SUB_BITS - 1;
+    return ((uint64_t)(HIST_SUB_COUNT + bucket % HIST_SUB_COUNT + 1) << (exponent - HIST_SUB_BITS)) - 1;
+}
+
+static inline void histogram_record(latencyHistogram * hist, uint64_t value)
+{
+    hist->counts[histogram_bucket(value)]++;
+    hist->total++;
+    if (value > hist->max)
+    {
+        hist->max = value;
+    }
+}
+
+// value at or below which a fraction q of the recorded values lie
+uint64_t histogram_percentile(const latencyHistogram * hist, double q)
+{
+    int bucket;
+    uint64_t seen = 0;
+    uint64_t target = (uint64_t)(q * hist->total + 0.5);
+
+    if (target < 1)
+    {
+        target = 1;
+    }
+    for ( bucket = 0 ; bucket < HIST_BUCKETS ; bucket++ )
+    {
+        seen += hist->counts[bucket];
+        if (seen >= target)
+        {
+            // never report more than was actually seen
+            return histogram_bucket_max(bucket) < hist->max ? histogram_bucket_max(bucket) : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+/* Per-frame timing. The control loop stamps the semaphore wake and the
+image's write time (md.writetime, set by the producer through
+ImageStreamIO); the conversion and send stages stamp the end of the
+conversion and the call and return of asdkSend(). With --pipeline, the
+sender also stamps when it picked the command up from the reader. All
+stamps use CLOCK_REALTIME, the clock ImageStreamIO writes with. Frames
+whose write time is unset, older than the session or later than the
+wake (a producer not filling it in) skip the write-relative
+histograms. */
+enum
+{
+    LAT_WRITE_TO_WAKE,
+    LAT_WAKE_TO_CONVERTED,
+    LAT_CONVERTED_TO_PICKED,
+    LAT_IN_SEND,
+    LAT_CONVERTED_TO_SENT,
+    LAT_WAKE_TO_SENT,
+    LAT_WRITE_TO_SENT,
+    N_LATENCIES
+};
+
+typedef struct
+{
+    latencyHistogram hist[N_LATENCIES];
+    struct timespec written;   // md.writetime of the frame being handled
+    struct timespec wake;      // semaphore wait returned
+    struct timespec converted; // conversion kernel finished
+    struct timespec picked;    // --pipeline: sender took the command (else unset)
+    struct timespec sending;   // asdkSend() called
+    struct timespec sent;      // asdkSend() returned
+    struct timespec start;     // session start; older write times are stale
+} latencyStats;
+
+static const char * latency_names[N_LATENCIES] = {
+    "write -> wake",
+    "wake -> converted",
+    "converted -> picked",
+    "in asdkSend",
+    "converted -> sent",
+    "wake -> sent",
+    "write -> sent",
+};
+
+void init_latency_stats(latencyStats * lat)
+{
+    int i;
+
+    memset(lat, 0, sizeof(latencyStats));
+    for ( i = 0 ; i < N_LATENCIES ; i++ )
+    {
+        lat->hist[i].name = latency_names[i];
+    }
+    clock_gettime(CLOCK_REALTIME, &lat->start);
+}
+
+static inline int64_t elapsed_ns(const struct timespec * start, const struct timespec * end)
+{
+    return (int64_t)(end->tv_sec - start->tv_sec) * 1000000000 + (end->tv_nsec - start->tv_nsec);
+}
+
+// called by the control loop as soon as the semaphore wait returns
+static inline void stamp_wake(struct timespec * wake, struct timespec * written, const IMAGE * SMimage)
+{
+    clock_gettime(CLOCK_REALTIME, wake);
+    *written = SMimage[0].md[0].writetime;
+}
+
+static inline void latency_wake(latencyStats * lat, const IMAGE * SMimage)
+{
+    stamp_wake(&lat->wake, &lat->written, SMimage);
+}
+
+static inline void latency_record_frame(latencyStats * lat)
+{
+    int64_t write_to_wake = elapsed_ns(&lat->written, &lat->wake);
+
+    histogram_record(&lat->hist[LAT_WAKE_TO_CONVERTED], elapsed_ns(&lat->wake, &lat->converted));
+    if (lat->picked.tv_sec != 0)
+    {
+        histogram_record(&lat->hist[LAT_CONVERTED_TO_PICKED], elapsed_ns(&lat->converted, &lat->picked));
+    }
+    histogram_record(&lat->hist[LAT_IN_SEND], elapsed_ns(&lat->sending, &lat->sent));
+    histogram_record(&lat->hist[LAT_CONVERTED_TO_SENT], elapsed_ns(&lat->converted, &lat->sent));
+    histogram_record(&lat->hist[LAT_WAKE_TO_SENT], elapsed_ns(&lat->wake, &lat->sent));
+    if (lat->written.tv_sec != 0 && elapsed_ns(&lat->start, &lat->written) >= 0 && write_to_wake >= 0)
+    {
+        histogram_record(&lat->hist[LAT_WRITE_TO_WAKE], write_to_wake);
+        histogram_record(&lat->hist[LAT_WRITE_TO_SENT], elapsed_ns(&lat->written, &lat->sent));
+    }
+}
+
+void print_latency_stats(const latencyStats * lat, const char * serial)
+{
+    int i;
+    const latencyHistogram * hist;
+
+    printf("ALPAO %s: latency (us)       frames      p50      p99    p99.9      max\n", serial);
+    for ( i = 0 ; i < N_LATENCIES ; i++ )
+    {
+        hist = &lat->hist[i];
+        if (hist->total == 0)
+        {
+            printf("  %-20s %12d        -        -        -        -\n", hist->name, 0);
+            continue;
+        }
+        printf("  %-20s %12lu %8.1f %8.1f %8.1f %8.1f\n", hist->name, (unsigned long) hist->total,
+               1e-3 * histogram_percentile(hist, 0.5), 1e-3 * histogram_percentile(hist, 0.99),
+               1e-3 * histogram_percentile(hist, 0.999), 1e-3 * hist->max);
+    }
+}
+
+/* Synchronized sends across DMs (woofer/tweeter). With --sync, every
+mirror's loop converts its frame and then meets the others at a barrier
+keyed on the frame ID, so all mirrors issue asdkSend() for the same
+frame together. The frame ID is a common frame number the producers
+write into each stream's md.cnt2 (--sync-id=cnt2), or by default the
+number of writes seen on the mirror's input since its loop started. A
+mirror that arrives with an older frame than the round in progress
+drops it and waits for a newer one; one that arrives after its round
+was released sends at once. If a round isn't complete within the
+timeout, the mirrors that made it send anyway and the round counts as
+timed out. The spread between the first and last asdkSend() call of
+each complete round goes in a histogram.
+
+Write counts drift apart for good if one producer started earlier or
+wrote once more than the others, and then no round ever completes.
+After SYNC_RESYNC_ROUNDS timed-out rounds in a row, the group re-bases:
+each mirror takes the next frame it brings as a new common frame ID,
+just past any seen so far. Producer frame IDs can't be re-based, so a
+mirror whose cnt2 trails the round in progress for SYNC_RESYNC_ROUNDS
+frames in a row fails its loop instead, shutting every DM down. */
+#define SYNC_RESYNC_ROUNDS 100
+typedef struct
+{
+    pthread_mutex_t lock;
+    int nmembers;
+    int64_t spin_ns;          // spin this long at the barrier before yielding
+    int64_t timeout_ns;
+    uint64_t frame;           // frame ID of the current round
+    uint64_t released;        // frame ID of the last round released
+    uint64_t generation;      // bumped when a round is released
+    int narrived;
+    int64_t deadline;
+    uint64_t issue_gen;       // round whose send times are being collected
+    int nissued;
+    int64_t first_issue, last_issue;
+    latencyHistogram spread;
+    unsigned long missed;     // timed-out rounds in a row
+    uint64_t epoch;           // frame ID the mirrors re-base onto
+    uint64_t rebase;          // bumped to ask every mirror to re-base
+    unsigned long rounds, timeouts, dropped, late, resyncs;
+} syncGroup;
+
+// one mirror's handle on the group, for the frame it is about to send
+typedef struct
+{
+    syncGroup * group;
+    const char * serial;
+    int producer_ids;         // frame IDs come from the producers (cnt2), never re-based
+    uint64_t frame;
+    uint64_t offset;          // added to write-count frame IDs by a re-base
+    uint64_t rebase;          // the group's rebase this offset belongs to
+    unsigned long behind;     // cnt2: frames dropped in a row
+    uint64_t generation;      // round the mirror was released in
+} dmSync;
+
+static inline void cpu_relax(void)
+{
+#ifdef HAVE_X86_SIMD
+    _mm_pause();
+#endif
+}
+
+static inline int64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void init_sync_group(syncGroup * g, int nmembers, double spin_us, double timeout_us)
+{
+    memset(g, 0, sizeof(syncGroup));
+    pthread_mutex_init(&g->lock, NULL);
+    g->nmembers = nmembers;
+    g->spin_ns = (int64_t)(spin_us * 1e3);
+    g->timeout_ns = (int64_t)(timeout_us * 1e3);
+    g->spread.name = "send spread";
+}
+
+// caller holds the lock
+static inline void release_round(syncGroup * g)
+{
+    g->released = g->frame;
+    g->narrived = 0;
+    __atomic_store_n(&g->generation, g->generation + 1, __ATOMIC_RELEASE);
+}
+
+/* Count a dropped frame; return -1 once producer frame IDs have trailed
+for SYNC_RESYNC_ROUNDS frames in a row. Caller holds the lock. */
+static int sync_dropped(dmSync * s, uint64_t frame)
+{
+    syncGroup * g = s->group;
+
+    g->dropped++;
+    if (!s->producer_ids || ++s->behind < SYNC_RESYNC_ROUNDS)
+    {
+        return 0;
+    }
+    printf("ALPAO %s: frame IDs (cnt2) have trailed the other mirrors for %d frames "
+           "(%llu behind); stopping.\n", s->serial, SYNC_RESYNC_ROUNDS,
+           (unsigned long long)(g->frame - frame));
+    return -1;
+}
+
+/* A round timed out: after SYNC_RESYNC_ROUNDS in a row on write counts,
+have every mirror re-base. Caller holds the lock. */
+static void sync_timed_out(syncGroup * g, const dmSync * s)
+{
+    g->timeouts++;
+    if (++g->missed < SYNC_RESYNC_ROUNDS || s->producer_ids)
+    {
+        return;
+    }
+    printf("ALPAO sync: %lu rounds in a row timed out; re-basing the mirrors' write counts.\n",
+           g->missed);
+    g->epoch = g->frame + 1;
+    g->rebase++;
+    g->missed = 0;
+    g->resyncs++;
+}
+
+/* Wait at the barrier with the frame in s->frame. Returns 1 when the
+mirror should send it now, 0 to drop it and -1 if its producer's frame
+IDs never catch up. */
+int sync_arrive(dmSync * s)
+{
+    syncGroup * g = s->group;
+    uint64_t gen;
+    uint64_t frame;
+    int64_t start, now;
+    int ret;
+
+    pthread_mutex_lock(&g->lock);
+    if (s->rebase != g->rebase)
+    {
+        s->offset = g->epoch - s->frame;
+        s->rebase = g->rebase;
+    }
+    frame = s->frame + s->offset;
+    if (frame < g->frame)
+    {
+        ret = sync_dropped(s, frame);
+        pthread_mutex_unlock(&g->lock);
+        return ret;
+    }
+    s->behind = 0;
+    if (frame == g->released)
+    {
+        // the others already sent this frame
+        g->late++;
+        s->generation = g->generation;
+        pthread_mutex_unlock(&g->lock);
+        return 1;
+    }
+    if (frame > g->frame)
+    {
+        // start a round; anyone waiting on an older frame drops out
+        __atomic_store_n(&g->frame, frame, __ATOMIC_RELEASE);
+        __atomic_store_n(&g->deadline, monotonic_ns() + g->timeout_ns, __ATOMIC_RELEASE);
+        g->narrived = 0;
+    }
+    g->narrived++;
+    gen = g->generation;
+    if (g->narrived == g->nmembers)
+    {
+        g->rounds++;
+        g->missed = 0;
+        release_round(g);
+        s->generation = gen + 1;
+        pthread_mutex_unlock(&g->lock);
+        return 1;
+    }
+    pthread_mutex_unlock(&g->lock);
+
+    start = monotonic_ns();
+    while (__atomic_load_n(&g->generation, __ATOMIC_ACQUIRE) == gen)
+    {
+        if (stop || __atomic_load_n(&g->frame, __ATOMIC_ACQUIRE) != frame)
+        {
+            pthread_mutex_lock(&g->lock);
+            g->dropped++;
+            pthread_mutex_unlock(&g->lock);
+            return 0;
+        }
+        now = monotonic_ns();
+        if (now >= __atomic_load_n(&g->deadline, __ATOMIC_ACQUIRE))
+        {
+            pthread_mutex_lock(&g->lock);
+            if (g->generation == gen && g->frame == frame)
+            {
+                sync_timed_out(g, s);
+                release_round(g);
+            }
+            pthread_mutex_unlock(&g->lock);
+            continue;
+        }
+        if (now - start < g->spin_ns)
+        {
+            cpu_relax();
+        } else
+        {
+            sched_yield();
+        }
+    }
+    s->generation = gen + 1;
+    return 1;
+}
+
+// note when this mirror called asdkSend() for the round it was released in
+void sync_issued(dmSync * s, int64_t issue_ns)
+{
+    syncGroup * g = s->group;
+
+    pthread_mutex_lock(&g->lock);
+    if (g->issue_gen != s->generation)
+    {
+        g->issue_gen = s->generation;
+        g->nissued = 0;
+        g->first_issue = issue_ns;
+        g->last_issue = issue_ns;
+    }
+    if (issue_ns < g->first_issue)
+    {
+        g->first_issue = issue_ns;
+    }
+    if (issue_ns > g->last_issue)
+    {
+        g->last_issue = issue_ns;
+    }
+    if (++g->nissued == g->nmembers)
+    {
+        histogram_record(&g->spread, (uint64_t)(g->last_issue - g->first_issue));
+    }
+    pthread_mutex_unlock(&g->lock);
+}
+
+void print_sync_stats(syncGroup * g)
+{
+    const latencyHistogram * hist = &g->spread;
+
+    printf("ALPAO sync: %lu rounds sent together, %lu timed out, %lu late, %lu stale frames dropped, "
+           "%lu resyncs.\n", g->rounds, g->timeouts, g->late, g->dropped, g->resyncs);
+    if (hist->total > 0)
+    {
+        printf("ALPAO sync: send spread (us)  rounds      p50      p99    p99.9      max\n");
+        printf("  %-20s %12lu %8.1f %8.1f %8.1f %8.1f\n", hist->name, (unsigned long) hist->total,
+               1e-3 * histogram_percentile(hist, 0.5), 1e-3 * histogram_percentile(hist, 0.99),
+               1e-3 * histogram_percentile(hist, 0.999), 1e-3 * hist->max);
+    }
+}
+
+/* Binary frame recorder (--record). Every command sent is recorded with
+the input it was converted from, the vector sent, its saturation mask
+and its timing. The sending thread only copies the record into a
+preallocated single-producer/single-consumer ring; a writer thread at
+normal priority, free to run on any core, drains the ring to disk. If
+the ring is full the record is dropped and counted, so the loop never
+waits on the disk.
+
+Records go into chunked files <prefix>_<serial>_NNNNNN.bin, each a
+64-byte recordFileHeader followed by fixed-size records, so a chunk can
+be mmapped and indexed directly. A record is a recordHeader, the input
+image (in its own element type, input_datatype in the header), the command (doubles) and the saturation mask (bytes),
+at the offsets given in the file header. nrecords in the header is
+filled in when the chunk is closed. */
+#define RECORD_MAGIC "ALPAOREC"
+#define RECORD_VERSION 2  // 1: float inputs only, no input_datatype
+
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;     // bytes before the first record
+    uint32_t record_size;
+    uint32_t nbAct;
+    uint32_t input_size[2];   // input image axes
+    uint32_t input_offset;    // offsets of the arrays within a record
+    uint32_t output_offset;
+    uint32_t satmask_offset;
+    uint32_t input_datatype;  // ImageStreamIO _DATATYPE_* of the input image
+    uint64_t nrecords;        // records in this chunk
+    uint64_t first_number;    // command number of the first record
+} recordFileHeader;
+
+typedef struct
+{
+    uint64_t number;          // command number, as in <shm_name>_cmdinfo
+    uint64_t written;         // CLOCK_REALTIME ns: input write, wake, send return
+    uint64_t wake;
+    uint64_t sent;
+    uint32_t nsat;
+    uint32_t reserved;
+} recordHeader;
+
+typedef struct
+{
+    recordFileHeader layout;
+    char prefix[MAX_STRLEN];
+    char * ring;
+    uint64_t capacity;        // records
+    size_t input_bytes;       // input image copied into each record
+    uint64_t head __attribute__((aligned(CACHE_LINE))); // written by the sending thread
+    uint64_t tail __attribute__((aligned(CACHE_LINE))); // written by the writer thread
+    unsigned long overflows __attribute__((aligned(CACHE_LINE)));
+    uint64_t chunk_records;   // records per file
+    FILE * file;
+    unsigned long chunk;
+    uint64_t written;         // records on disk
+    int running;
+    int failed;
+    pthread_t writer;
+} frameRecorder;
+
+static inline uint64_t timespec_ns(const struct timespec * ts)
+{
+    return (uint64_t) ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+static inline size_t align8(size_t n)
+{
+    return (n + 7) & ~(size_t) 7;
+}
+
+static int open_record_chunk(frameRecorder * rec, uint64_t first_number)
+{
+    char path[MAX_STRLEN + 32];
+
+    snprintf(path, sizeof(path), "%s_%06lu.bin", rec->prefix, rec->chunk);
+    rec->file = fopen(path, "wb");
+    if (rec->file == NULL)
+    {
+        printf("ALPAO recorder: could not open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    rec->layout.nrecords = 0;
+    rec->layout.first_number = first_number;
+    fwrite(&rec->layout, sizeof(recordFileHeader), 1, rec->file);
+    return 0;
+}
+
+static void close_record_chunk(frameRecorder * rec)
+{
+    if (rec->file == NULL)
+    {
+        return;
+    }
+    // the header goes in last, with the record count
+    fseek(rec->file, 0, SEEK_SET);
+    fwrite(&rec->layout, sizeof(recordFileHeader), 1, rec->file);
+    fclose(rec->file);
+    rec->file = NULL;
+    rec->chunk++;
+}
+
+// writer thread: drain the ring into the chunk files
+void * run_recorder(void * arg)
+{
+    frameRecorder * rec = (frameRecorder *) arg;
+    struct timespec idle = {0, 1000000};
+    uint64_t head, tail;
+    const char * record;
+    int running;
+
+    do
+    {
+        running = __atomic_load_n(&rec->running, __ATOMIC_ACQUIRE);
+        head = __atomic_load_n(&rec->head, __ATOMIC_ACQUIRE);
+        tail = rec->tail;
+        if (head == tail)
+        {
+            nanosleep(&idle, NULL);
+            continue;
+        }
+        for ( ; tail != head ; tail++ )
+        {
+            record = rec->ring + (tail % rec->capacity) * rec->layout.record_size;
+            if (rec->file == NULL && !rec->failed &&
+                open_record_chunk(rec, ((const recordHeader *) record)->number) == -1)
+            {
+                rec->failed = 1;
+            }
+            if (rec->file != NULL)
+            {
+                fwrite(record, rec->layout.record_size, 1, rec->file);
+                rec->layout.nrecords++;
+                rec->written++;
+                if (rec->layout.nrecords == rec->chunk_records)
+                {
+                    close_record_chunk(rec);
+                }
+            }
+            __atomic_store_n(&rec->tail, tail + 1, __ATOMIC_RELEASE);
+        }
+    } while (running || head != tail);
+
+    close_record_chunk(rec);
+    return NULL;
+}
+
+/* Attributes for helper threads (recorder, calibration reload): they must
+not inherit the loop's real-time priority or core, so they run
+SCHED_OTHER on any CPU */
+void background_thread_attr(pthread_attr_t * attr)
+{
+    struct sched_param param;
+    cpu_set_t cpuset;
+    long ncpu, cpu;
+
+    pthread_attr_init(attr);
+    pthread_attr_setinheritsched(attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(attr, SCHED_OTHER);
+    memset(&param, 0, sizeof(param));
+    pthread_attr_setschedparam(attr, &param);
+    CPU_ZERO(&cpuset);
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    for ( cpu = 0 ; cpu < ncpu && cpu < CPU_SETSIZE ; cpu++ )
+    {
+        CPU_SET(cpu, &cpuset);
+    }
+    pthread_attr_setaffinity_np(attr, sizeof(cpuset), &cpuset);
+}
+
+frameRecorder * start_recorder(const char * prefix, const char * serial, int nbAct,
+                               const IMAGE * SMimage, unsigned long capacity,
+                               unsigned long chunk_records)
+{
+    frameRecorder * rec;
+    pthread_attr_t attr;
+    size_t ringbytes;
+
+    if (posix_memalign((void **) &rec, CACHE_LINE, sizeof(frameRecorder)) != 0)
+    {
+        return NULL;
+    }
+    memset(rec, 0, sizeof(frameRecorder));
+    snprintf(rec->prefix, MAX_STRLEN, "%s_%s", prefix, serial);
+    memcpy(rec->layout.magic, RECORD_MAGIC, 8);
+    rec->layout.version = RECORD_VERSION;
+    rec->layout.header_size = sizeof(recordFileHeader);
+    rec->layout.nbAct = nbAct;
+    rec->layout.input_size[0] = SMimage[0].md[0].size[0];
+    rec->layout.input_size[1] = SMimage[0].md[0].naxis > 1 ? SMimage[0].md[0].size[1] : 1;
+    rec->layout.input_offset = sizeof(recordHeader);
+    rec->layout.input_datatype = SMimage[0].md[0].datatype;
+    rec->input_bytes = (size_t) rec->layout.input_size[0] * rec->layout.input_size[1] *
+                       input_types[input_type_of(SMimage[0].md[0].datatype)].size;
+    rec->layout.output_offset = align8(rec->layout.input_offset + rec->input_bytes);
+    rec->layout.satmask_offset = rec->layout.output_offset + nbAct * sizeof(Scalar);
+    rec->layout.record_size = align8(rec->layout.satmask_offset + nbAct);
+    rec->capacity = capacity;
+    rec->chunk_records = chunk_records;
+
+    ringbytes = (size_t) capacity * rec->layout.record_size;
+    if (posix_memalign((void **) &rec->ring, CACHE_LINE, ringbytes) != 0)
+    {
+        printf("ALPAO %s: could not allocate a %lu record ring\n", serial, capacity);
+        free(rec);
+        return NULL;
+    }
+    memset(rec->ring, 0, ringbytes);
+
+    background_thread_attr(&attr);
+    rec->running = 1;
+    if (pthread_create(&rec->writer, &attr, run_recorder, rec) != 0)
+    {
+        printf("ALPAO %s: could not start the recorder thread\n", serial);
+        pthread_attr_destroy(&attr);
+        free(rec->ring);
+        free(rec);
+        return NULL;
+    }
+    pthread_attr_destroy(&attr);
+    printf("ALPAO %s: recording to %s_*.bin (%u byte records, ring of %lu).\n",
+           serial, rec->prefix, rec->layout.record_size, capacity);
+    return rec;
+}
+
+// sending thread: copy one record into the ring, or count it as lost
+static inline void record_frame(frameRecorder * rec, uint64_t number, const commandBuffers * buf,
+                                const latencyStats * lat)
+{
+    uint64_t head = rec->head;
+    char * record;
+    recordHeader * hdr;
+
+    if (head - __atomic_load_n(&rec->tail, __ATOMIC_ACQUIRE) == rec->capacity)
+    {
+        rec->overflows++;
+        return;
+    }
+    record = rec->ring + (head % rec->capacity) * rec->layout.record_size;
+    hdr = (recordHeader *) record;
+    hdr->number = number;
+    hdr->written = timespec_ns(&lat->written);
+    hdr->wake = timespec_ns(&lat->wake);
+    hdr->sent = timespec_ns(&lat->sent);
+    hdr->nsat = buf->nsat;
+    memcpy(record + rec->layout.input_offset, buf->input, rec->input_bytes);
+    memcpy(record + rec->layout.output_offset, buf->command, rec->layout.nbAct * sizeof(Scalar));
+    memcpy(record + rec->layout.satmask_offset, buf->satmask, rec->layout.nbAct);
+    __atomic_store_n(&rec->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void stop_recorder(frameRecorder * rec, const char * serial)
+{
+    __atomic_store_n(&rec->running, 0, __ATOMIC_RELEASE);
+    pthread_join(rec->writer, NULL);
+    printf("ALPAO %s: recorded %lu frames in %lu files, %lu lost to a full ring.\n",
+           serial, (unsigned long) rec->written, rec->chunk, rec->overflows);
+    free(rec->ring);
+    free(rec);
+}
+
+/* Command telemetry. After each asdkSend(), the vector actually sent
+(post normalization, bias and clipping, in fractional stroke) goes into
+the <shm_name>_cmd stream, so other processes on the RTC can see what
+the mirror is doing. The stream is a circular buffer of depth slices,
+nbAct x 1 x depth doubles, with md.cnt1 the slice last written and
+md.cnt0 the number of commands published. The companion
+<shm_name>_cmdinfo stream (4 x 1 x depth uint64) holds, for the same
+slice, the command number and the CLOCK_REALTIME write, wake and sent
+times in ns. Both are filled in before either is posted, and both are
+posted, _cmdinfo first, so a reader can wait on either stream and find
+the other's slice ready. Publishing is a memcpy of the vector plus a
+few stores. */
+enum { CMDINFO_NUMBER, CMDINFO_WRITTEN, CMDINFO_WAKE, CMDINFO_SENT, CMDINFO_FIELDS };
+
+typedef struct
+{
+    IMAGE * cmd;
+    IMAGE * info;
+    int nbAct;
+    uint32_t depth;
+    uint64_t published;       // commands sent so far
+    frameRecorder * rec;      // --record, or NULL
+} commandTelemetry;
+
+IMAGE * initializeTelemetryStream(const char * name, uint32_t width, uint32_t depth,
+                                  uint8_t datatype)
+{
+    uint32_t imsize[3];
+    IMAGE * SMimage;
+
+    imsize[0] = width;
+    imsize[1] = 1;
+    imsize[2] = depth;
+
+    SMimage = (IMAGE*) malloc(sizeof(IMAGE));
+    if (SMimage == NULL)
+    {
+        return NULL;
+    }
+    ImageStreamIO_createIm(&SMimage[0], name, 3, imsize, datatype, 1, 0, 0);
+    SMimage[0].md[0].cnt1 = depth - 1; // so the first command lands in slice 0
+    return SMimage;
+}
+
+// close and free whichever telemetry streams were set up
+void free_command_telemetry(commandTelemetry * tel)
+{
+    if (tel->cmd != NULL)
+    {
+        ImageStreamIO_closeIm(&tel->cmd[0]);
+        free(tel->cmd);
+        tel->cmd = NULL;
+    }
+    if (tel->info != NULL)
+    {
+        ImageStreamIO_closeIm(&tel->info[0]);
+        free(tel->info);
+        tel->info = NULL;
+    }
+}
+
+int init_command_telemetry(commandTelemetry * tel, const char * shm_name, int nbAct, int depth)
+{
+    char name[MAX_STRLEN];
+
+    tel->nbAct = nbAct;
+    tel->depth = depth;
+    tel->published = 0;
+    tel->cmd = NULL;
+    tel->info = NULL;
+    tel->rec = NULL;
+    if (depth <= 0)
+    {
+        return 0;
+    }
+
+    snprintf(name, MAX_STRLEN, "%s_cmd", shm_name);
+    tel->cmd = initializeTelemetryStream(name, nbAct, depth, _DATATYPE_DOUBLE);
+    snprintf(name, MAX_STRLEN, "%s_cmdinfo", shm_name);
+    tel->info = initializeTelemetryStream(name, CMDINFO_FIELDS, depth, _DATATYPE_UINT64);
+    if (tel->cmd == NULL || tel->info == NULL)
+    {
+        printf("Could not set up command telemetry\n");
+        free_command_telemetry(tel);
+        return -1;
+    }
+    memset(tel->cmd[0].array.D, 0, (size_t) nbAct * depth * sizeof(double));
+    memset(tel->info[0].array.UI64, 0, (size_t) CMDINFO_FIELDS * depth * sizeof(uint64_t));
+    return 0;
+}
+
+/* Direct mode (--direct). The producer writes commands already in ALPAO
+actuator order and fractional stroke, as doubles, into a ring of slices
+(nbAct x 1 x depth, as <shm_name>_cmd): it fills slice (cnt1 + 1) % depth,
+then sets cnt1 to it, increments cnt0 and posts. There is nothing to
+convert, so the slice itself is passed to asdkSend(). The producer only
+ever writes the next slice, so the one being sent stays put unless the
+producer laps the ring: the slice taken at cnt0 = c is rewritten by
+frame c + depth, which the producer starts once cnt0 reaches
+c + depth - 1. cnt0 is checked again after the range check and after
+the send. A command with values beyond +-1, or a slice lapped before
+the send, is copied into the command buffer and clipped there. A slice
+lapped during the send may have reached the mirror with unchecked
+values, so the newest command is resent at once from a clipped copy and
+counted. --direct is not combined with --pipeline, whose hand-over would
+stretch that window to a whole send. */
+#define DIRECT_DEPTH 4
+
+// Create (or reuse) the direct input ring and zero it, like initializeSharedMemory()
+int initializeDirectStream(const char * shm_name, int nbAct, int depth)
+{
+    uint32_t imsize[3];
+    IMAGE * SMimage;
+    int reuse = 0;
+
+    imsize[0] = nbAct;
+    imsize[1] = 1;
+    imsize[2] = depth;
+
+    SMimage = (IMAGE*) malloc(sizeof(IMAGE));
+    if (SMimage == NULL)
+    {
+        return -1;
+    }
+    if (ImageStreamIO_openIm(&SMimage[0], shm_name) == 0)
+    {
+        reuse = (SMimage[0].md[0].naxis == 3 &&
+                 SMimage[0].md[0].size[0] == imsize[0] &&
+                 SMimage[0].md[0].size[1] == imsize[1] &&
+                 SMimage[0].md[0].size[2] == imsize[2] &&
+                 SMimage[0].md[0].datatype == _DATATYPE_DOUBLE);
+        if (!reuse)
+        {
+            ImageStreamIO_closeIm(&SMimage[0]);
+        }
+    }
+    if (!reuse)
+    {
+        ImageStreamIO_createIm(&SMimage[0], shm_name, 3, imsize, _DATATYPE_DOUBLE, 1, 10, 0);
+    }
+    ImageStreamIO_semflush(&SMimage[0], -1);
+
+    SMimage[0].md[0].write = 1;
+    memset(SMimage[0].array.D, 0, (size_t) nbAct * depth * sizeof(double));
+    clock_gettime(CLOCK_REALTIME, &SMimage[0].md[0].writetime);
+    ImageStreamIO_sempost(&SMimage[0], -1);
+    SMimage[0].md[0].write = 0;
+    SMimage[0].md[0].cnt1 = 0;
+    SMimage[0].md[0].cnt0++;
+    return 0;
+}
+
+// the producer may have started rewriting the slice taken at cnt0 = taken
+static inline int direct_lapped(const IMAGE * SMimage, uint64_t taken)
+{
+    return __atomic_load_n(&SMimage[0].md[0].cnt0, __ATOMIC_ACQUIRE) - taken >=
+           SMimage[0].md[0].size[2] - 1;
+}
+
+// newest slice, and the cnt0 it was taken at
+static inline const Scalar * direct_slice(const IMAGE * SMimage, int nbAct, uint64_t * taken)
+{
+    *taken = __atomic_load_n(&SMimage[0].md[0].cnt0, __ATOMIC_ACQUIRE);
+    return SMimage[0].array.D +
+           (size_t)(SMimage[0].md[0].cnt1 % SMimage[0].md[0].size[2]) * nbAct;
+}
+
+// copy the newest slice into the command buffer and clip it there
+static inline void direct_copy(const IMAGE * SMimage, commandBuffers * buf)
+{
+    const Scalar * slice;
+    uint64_t taken;
+
+    do
+    {
+        slice = direct_slice(SMimage, buf->nbAct, &taken);
+        memcpy(buf->dminputs, slice, buf->nbAct * sizeof(Scalar));
+    } while (direct_lapped(SMimage, taken));
+    buf->nsat = clip_to_limits(buf->dminputs, buf->satmask, buf->nbAct);
+    buf->command = buf->dminputs;
+    buf->input = buf->dminputs;
+    buf->ring = NULL;
+}
+
+// direct mode's "conversion": point the command at the newest slice, copying only to clip
+static inline void direct_frame(const IMAGE * SMimage, commandBuffers * buf)
+{
+    const Scalar * slice;
+    uint64_t taken;
+    int idx, out = 0;
+
+    slice = direct_slice(SMimage, buf->nbAct, &taken);
+    for ( idx = 0 ; idx < buf->nbAct ; idx++ )
+    {
+        out |= (slice[idx] > 1) | (slice[idx] < -1);
+    }
+    if (out || direct_lapped(SMimage, taken))
+    {
+        direct_copy(SMimage, buf);
+    } else
+    {
+        buf->nsat = 0;
+        buf->command = slice;
+        buf->input = slice;
+        buf->ring = SMimage;
+        buf->ring_cnt0 = taken;
+    }
+}
+
+// publish the command just sent, with its timing
+static inline void publish_command(commandTelemetry * tel, const Scalar * dminputs,
+                                   const latencyStats * lat)
+{
+    uint32_t slice;
+    uint64_t * info;
+
+    if (tel->cmd == NULL)
+    {
+        return;
+    }
+    slice = (tel->cmd[0].md[0].cnt1 + 1) % tel->depth;
+    info = &tel->info[0].array.UI64[(size_t) slice * CMDINFO_FIELDS];
+
+    tel->cmd[0].md[0].write = 1;
+    tel->info[0].md[0].write = 1;
+    memcpy(&tel->cmd[0].array.D[(size_t) slice * tel->nbAct], dminputs, tel->nbAct * sizeof(Scalar));
+    info[CMDINFO_NUMBER] = tel->published;
+    info[CMDINFO_WRITTEN] = timespec_ns(&lat->written);
+    info[CMDINFO_WAKE] = timespec_ns(&lat->wake);
+    info[CMDINFO_SENT] = timespec_ns(&lat->sent);
+
+    tel->info[0].md[0].cnt1 = slice;
+    tel->info[0].md[0].cnt0++;
+    tel->info[0].md[0].writetime = lat->sent;
+    tel->info[0].md[0].write = 0;
+    tel->cmd[0].md[0].cnt1 = slice;
+    tel->cmd[0].md[0].cnt0++;
+    tel->cmd[0].md[0].writetime = lat->sent;
+    tel->cmd[0].md[0].write = 0;
+    ImageStreamIO_sempost(&tel->info[0], -1);
+    ImageStreamIO_sempost(&tel->cmd[0], -1);
+}
+
+/* Modal input (--modal). The input stream holds the AO loop's modal
+coefficients, an nmodes x 1 vector, and <serial>_modes.fits in
+ALPAO_CALIB the modes-to-actuator matrix: one row of nmodes weights per
+actuator, in ALPAO actuator order (NAXIS1 = nmodes, NAXIS2 = nbAct).
+Each frame modal_product() expands the coefficients into actuator
+values, in the same units as an image input, and the conversion kernel
+takes them from there in actuator order (a NULL mapping), so
+normalization, bias and clipping are unchanged.
+
+The product is cache blocked: matrix rows are padded to whole cache
+lines, MODAL_BLOCK coefficients at a time stay in L1 while the kernel
+streams the rows past them, and rows are taken MODAL_ROWS at a time so
+each coefficient load serves several rows. With --modal-threads=N the
+rows are split into N slices of whole cache lines of output. The loop
+computes the first slice and N - 1 helper threads the others; they are
+started by bumping a frame counter (and posting their semaphores when
+they sleep between frames) and joined by spinning on a count of
+finished slices. The helpers spin between frames only outside
+--wait=sem, and only when --modal-cpus gives each a core of its own;
+a helper spinning at the loop's priority on a core it shares could
+starve the thread it is waiting for, so otherwise they sleep. */
+#define MODAL_BLOCK 512       // coefficients per block (4 KiB)
+#define MODAL_ROWS 4          // rows sharing each coefficient load
+#define MAX_MODAL_THREADS 16
+
+typedef void (*modalKernel)(const double * matrix, size_t stride, const double * coeffs,
+                            Scalar * out, int row0, int row1);
+
+typedef struct
+{
+    struct modalProduct * mp;
+    int slice;
+} modalHelper;
+
+typedef struct modalProduct
+{
+    const char * serial;
+    int nmodes;
+    int nbAct;
+    size_t stride;            // doubles per matrix row, a whole number of cache lines
+    double * matrix;          // nbAct rows
+    double * coeffs;          // this frame's coefficients, zero-padded to stride
+    Scalar * out;             // actuator values
+    int dtype;                // INPUT_* of the coefficient stream
+    double input_scale;
+    modalKernel kernel;
+    int nthreads;
+    int rows[MAX_MODAL_THREADS + 1]; // slice i is rows[i] to rows[i + 1]
+    int rtprio;               // helpers' SCHED_FIFO priority, the loop's
+    int cpus[MAX_MODAL_THREADS]; // helpers' cores, -1 to leave affinity alone
+    int wait_sem;             // helpers sleep on go[] between frames
+    uint64_t frame;           // products started
+    uint64_t done;            // slices finished by helpers
+    int running;
+    sem_t go[MAX_MODAL_THREADS];
+    pthread_t threads[MAX_MODAL_THREADS];
+    modalHelper helpers[MAX_MODAL_THREADS];
+} modalProduct;
+
+void modal_scalar(const double * matrix, size_t stride, const double * coeffs, Scalar * out,
+                  int row0, int row1)
+{
+    size_t m0, m, mend;
+    int r;
+    double acc;
+
+    for ( r = row0 ; r < row1 ; r++ )
+    {
+        out[r] = 0;
+    }
+    for ( m0 = 0 ; m0 < stride ; m0 += MODAL_BLOCK )
+    {
+        mend = m0 + MODAL_BLOCK < stride ? m0 + MODAL_BLOCK : stride;
+        for ( r = row0 ; r < row1 ; r++ )
+        {
+            acc = 0;
+            for ( m = m0 ; m < mend ; m++ )
+            {
+                acc += matrix[r * stride + m] * coeffs[m];
+            }
+            out[r] += acc;
+        }
+    }
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2")))
+void modal_sse2(const double * matrix, size_t stride, const double * coeffs, Scalar * out,
+                int row0, int row1)
+{
+    size_t m0, m, mend;
+    int r;
+    const double * row;
+    __m128d c, a0, a1, a2, a3;
+
+    for ( r = row0 ; r < row1 ; r++ )
+    {
+        out[r] = 0;
+    }
+    for ( m0 = 0 ; m0 < stride ; m0 += MODAL_BLOCK )
+    {
+        mend = m0 + MODAL_BLOCK < stride ? m0 + MODAL_BLOCK : stride;
+        for ( r = row0 ; r + MODAL_ROWS <= row1 ; r += MODAL_ROWS )
+        {
+            row = matrix + r * stride;
+            a0 = a1 = a2 = a3 = _mm_setzero_pd();
+            for ( m = m0 ; m < mend ; m += 2 )
+            {
+                c = _mm_load_pd(coeffs + m);
+                a0 = _mm_add_pd(a0, _mm_mul_pd(_mm_load_pd(row + m), c));
+                a1 = _mm_add_pd(a1, _mm_mul_pd(_mm_load_pd(row + stride + m), c));
+                a2 = _mm_add_pd(a2, _mm_mul_pd(_mm_load_pd(row + 2 * stride + m), c));
+                a3 = _mm_add_pd(a3, _mm_mul_pd(_mm_load_pd(row + 3 * stride + m), c));
+            }
+            out[r] += _mm_cvtsd_f64(_mm_add_sd(a0, _mm_unpackhi_pd(a0, a0)));
+            out[r + 1] += _mm_cvtsd_f64(_mm_add_sd(a1, _mm_unpackhi_pd(a1, a1)));
+            out[r + 2] += _mm_cvtsd_f64(_mm_add_sd(a2, _mm_unpackhi_pd(a2, a2)));
+            out[r + 3] += _mm_cvtsd_f64(_mm_add_sd(a3, _mm_unpackhi_pd(a3, a3)));
+        }
+        for ( ; r < row1 ; r++ )
+        {
+            row = matrix + r * stride;
+            a0 = _mm_setzero_pd();
+            for ( m = m0 ; m < mend ; m += 2 )
+            {
+                a0 = _mm_add_pd(a0, _mm_mul_pd(_mm_load_pd(row + m), _mm_load_pd(coeffs + m)));
+            }
+            out[r] += _mm_cvtsd_f64(_mm_add_sd(a0, _mm_unpackhi_pd(a0, a0)));
+        }
+    }
+}
+
+static inline __attribute__((always_inline)) __attribute__((target("avx2")))
+double hsum_avx2(__m256d v)
+{
+    __m128d s = _mm_add_pd(_mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1));
+
+    return _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(s, s)));
+}
+
+__attribute__((target("avx2")))
+void modal_avx2(const double * matrix, size_t stride, const double * coeffs, Scalar * out,
+                int row0, int row1)
+{
+    size_t m0, m, mend;
+    int r;
+    const double * row;
+    __m256d c, a0, a1, a2, a3;
+
+    for ( r = row0 ; r < row1 ; r++ )
+    {
+        out[r] = 0;
+    }
+    for ( m0 = 0 ; m0 < stride ; m0 += MODAL_BLOCK )
+    {
+        mend = m0 + MODAL_BLOCK < stride ? m0 + MODAL_BLOCK : stride;
+        for ( r = row0 ; r + MODAL_ROWS <= row1 ; r += MODAL_ROWS )
+        {
+            row = matrix + r * stride;
+            a0 = a1 = a2 = a3 = _mm256_setzero_pd();
+            for ( m = m0 ; m < mend ; m += 4 )
+            {
+                c = _mm256_load_pd(coeffs + m);
+                a0 = _mm256_add_pd(a0, _mm256_mul_pd(_mm256_load_pd(row + m), c));
+                a1 = _mm256_add_pd(a1, _mm256_mul_pd(_mm256_load_pd(row + stride + m), c));
+                a2 = _mm256_add_pd(a2, _mm256_mul_pd(_mm256_load_pd(row + 2 * stride + m), c));
+                a3 = _mm256_add_pd(a3, _mm256_mul_pd(_mm256_load_pd(row + 3 * stride + m), c));
+            }
+            out[r] += hsum_avx2(a0);
+            out[r + 1] += hsum_avx2(a1);
+            out[r + 2] += hsum_avx2(a2);
+            out[r + 3] += hsum_avx2(a3);
+        }
+        for ( ; r < row1 ; r++ )
+        {
+            row = matrix + r * stride;
+            a0 = _mm256_setzero_pd();
+            for ( m = m0 ; m < mend ; m += 4 )
+            {
+                a0 = _mm256_add_pd(a0, _mm256_mul_pd(_mm256_load_pd(row + m),
+                                                     _mm256_load_pd(coeffs + m)));
+            }
+            out[r] += hsum_avx2(a0);
+        }
+    }
+}
+
+__attribute__((target("avx512f")))
+void modal_avx512(const double * matrix, size_t stride, const double * coeffs, Scalar * out,
+                  int row0, int row1)
+{
+    size_t m0, m, mend;
+    int r;
+    const double * row;
+    __m512d c, a0, a1, a2, a3;
+
+    for ( r = row0 ; r < row1 ; r++ )
+    {
+        out[r] = 0;
+    }
+    for ( m0 = 0 ; m0 < stride ; m0 += MODAL_BLOCK )
+    {
+        mend = m0 + MODAL_BLOCK < stride ? m0 + MODAL_BLOCK : stride;
+        for ( r = row0 ; r + MODAL_ROWS <= row1 ; r += MODAL_ROWS )
+        {
+            row = matrix + r * stride;
+            a0 = a1 = a2 = a3 = _mm512_setzero_pd();
+            for ( m = m0 ; m < mend ; m += 8 )
+            {
+                c = _mm512_load_pd(coeffs + m);
+                a0 = _mm512_fmadd_pd(_mm512_load_pd(row + m), c, a0);
+                a1 = _mm512_fmadd_pd(_mm512_load_pd(row + stride + m), c, a1);
+                a2 = _mm512_fmadd_pd(_mm512_load_pd(row + 2 * stride + m), c, a2);
+                a3 = _mm512_fmadd_pd(_mm512_load_pd(row + 3 * stride + m), c, a3);
+            }
+            out[r] += _mm512_reduce_add_pd(a0);
+            out[r + 1] += _mm512_reduce_add_pd(a1);
+            out[r + 2] += _mm512_reduce_add_pd(a2);
+            out[r + 3] += _mm512_reduce_add_pd(a3);
+        }
+        for ( ; r < row1 ; r++ )
+        {
+            row = matrix + r * stride;
+            a0 = _mm512_setzero_pd();
+            for ( m = m0 ; m < mend ; m += 8 )
+            {
+                a0 = _mm512_fmadd_pd(_mm512_load_pd(row + m), _mm512_load_pd(coeffs + m), a0);
+            }
+            out[r] += _mm512_reduce_add_pd(a0);
+        }
+    }
+}
+#endif
+
+// same names and order as convert_kernels, so --kernel picks both
+typedef struct
+{
+    const char * name;
+    const char * cpu_feature;
+    modalKernel kernel;
+} modalKernelEntry;
+
+static const modalKernelEntry modal_kernels[] = {
+#ifdef HAVE_X86_SIMD
+    {"avx512", "avx512f", modal_avx512},
+    {"avx2",   "avx2",    modal_avx2},
+    {"sse2",   "sse2",    modal_sse2},
+#endif
+    {"scalar", NULL,      modal_scalar},
+};
+#define N_MODAL_KERNELS (int)(sizeof(modal_kernels) / sizeof(modal_kernels[0]))
+
+/* Read <serial>_modes.fits into a padded, aligned matrix with one row
+per actuator. Every weight must be finite. */
+static int read_modes_matrix(const char * serial, modalProduct * mp, int nbAct)
+{
+    fitsfile *fptr;
+    int status = 0;
+    int naxis, r;
+    long naxes[2] = {0, 0};
+    long fpixel[2];
+    size_t m;
+    char path[MAX_STRLEN*3];
+
+    if (calibration_path(serial, "_modes.fits", path, sizeof(path)) == -1)
+    {
+        return -1;
+    }
+    if (fits_open_image(&fptr, path, READONLY, &status))
+    {
+        fits_report_error(stderr, status);
+        printf("ALPAO %s: could not open the modal matrix %s\n", serial, path);
+        return -1;
+    }
+    fits_get_img_dim(fptr, &naxis, &status);
+    fits_get_img_size(fptr, 2, naxes, &status);
+    if (status || naxis != 2 || naxes[0] < 1 || naxes[1] != nbAct)
+    {
+        printf("ALPAO %s: %s must be nmodes x %d (one row per actuator), not %ldx%ld\n",
+               serial, path, nbAct, naxes[0], naxes[1]);
+        fits_close_file(fptr, &status);
+        return -1;
+    }
+
+    mp->nmodes = (int) naxes[0];
+    mp->stride = (mp->nmodes + CACHE_LINE / sizeof(double) - 1) & ~(CACHE_LINE / sizeof(double) - 1);
+    if (posix_memalign((void **) &mp->matrix, CACHE_LINE, nbAct * mp->stride * sizeof(double)) != 0)
+    {
+        printf("Memory allocation error\n");
+        fits_close_file(fptr, &status);
+        return -1;
+    }
+    memset(mp->matrix, 0, nbAct * mp->stride * sizeof(double));
+
+    fpixel[0] = 1;
+    for ( r = 0 ; r < nbAct && !status ; r++ )
+    {
+        fpixel[1] = r + 1;
+        fits_read_pix(fptr, TDOUBLE, fpixel, mp->nmodes, 0, mp->matrix + r * mp->stride, 0, &status);
+    }
+    fits_close_file(fptr, &status);
+    if (status)
+    {
+        fits_report_error(stderr, status);
+        free(mp->matrix);
+        return -1;
+    }
+    for ( m = 0 ; m < nbAct * mp->stride ; m++ )
+    {
+        if (!isfinite(mp->matrix[m]))
+        {
+            printf("ALPAO %s: %s has a non-finite weight for actuator %zu\n", serial, path,
+                   m / mp->stride);
+            free(mp->matrix);
+            return -1;
+        }
+    }
+    printf("ALPAO %s: using the %d-mode matrix from %s\n", serial, mp->nmodes, path);
+    return 0;
+}
+
+/* Compare a modal kernel with modal_scalar() on the session's matrix
+and random coefficients, every slice boundary included. Returns 0 if
+every actuator agrees to within rounding of the sum of its terms. */
+static int verify_modal_kernel(const modalProduct * mp, modalKernel kernel)
+{
+    int r, i;
+    size_t m;
+    int result = 0;
+    unsigned int seed = 12345;
+    double * coeffs;
+    Scalar * expected;
+    Scalar * actual;
+    double bound;
+
+    coeffs = NULL;
+    expected = (Scalar *) malloc(mp->nbAct * sizeof(Scalar));
+    actual = (Scalar *) malloc(mp->nbAct * sizeof(Scalar));
+    if (expected == NULL || actual == NULL ||
+        posix_memalign((void **) &coeffs, CACHE_LINE, mp->stride * sizeof(double)) != 0)
+    {
+        free(expected);
+        free(actual);
+        return -1;
+    }
+    memset(coeffs, 0, mp->stride * sizeof(double));
+    for ( m = 0 ; m < (size_t) mp->nmodes ; m++ )
+    {
+        coeffs[m] = (double) rand_r(&seed) / RAND_MAX - 0.5;
+    }
+
+    modal_scalar(mp->matrix, mp->stride, coeffs, expected, 0, mp->nbAct);
+    for ( i = 0 ; i < mp->nthreads ; i++ )
+    {
+        kernel(mp->matrix, mp->stride, coeffs, actual, mp->rows[i], mp->rows[i + 1]);
+    }
+    for ( r = 0 ; r < mp->nbAct ; r++ )
+    {
+        bound = 0;
+        for ( m = 0 ; m < (size_t) mp->nmodes ; m++ )
+        {
+            bound += fabs(mp->matrix[r * mp->stride + m] * coeffs[m]);
+        }
+        if (fabs(expected[r] - actual[r]) > 1e-12 * (1 + bound))
+        {
+            result = -1;
+        }
+    }
+    free(coeffs);
+    free(expected);
+    free(actual);
+    return result;
+}
+
+/* Load the matrix and set up the product for a coefficient stream of the
+given type. The rows are split into at most nthreads slices of whole
+cache lines of output; requested is the --kernel name, NULL for the
+fastest one that matches modal_scalar(). The helper threads are started
+separately, by start_modal_helpers(). */
+modalProduct * init_modal_product(const char * serial, int nbAct, int nthreads,
+                                  const char * requested)
+{
+    modalProduct * mp;
+    int i, chunk;
+    int automatic = (requested == NULL || strcmp(requested, "auto") == 0);
+    const int per_line = CACHE_LINE / sizeof(Scalar);
+
+    mp = (modalProduct *) calloc(1, sizeof(modalProduct));
+    if (mp == NULL)
+    {
+        return NULL;
+    }
+    mp->serial = serial;
+    mp->nbAct = nbAct;
+    if (read_modes_matrix(serial, mp, nbAct) == -1)
+    {
+        free(mp);
+        return NULL;
+    }
+    if (posix_memalign((void **) &mp->coeffs, CACHE_LINE, mp->stride * sizeof(double)) != 0 ||
+        posix_memalign((void **) &mp->out, CACHE_LINE, nbAct * sizeof(Scalar)) != 0)
+    {
+        printf("Memory allocation error\n");
+        free(mp->matrix);
+        free(mp->coeffs);
+        free(mp);
+        return NULL;
+    }
+    memset(mp->coeffs, 0, mp->stride * sizeof(double));
+    memset(mp->out, 0, nbAct * sizeof(Scalar));
+    mp->input_scale = 1.0;
+
+    // no slice smaller than a cache line of output
+    chunk = (nbAct + per_line - 1) / per_line;
+    mp->nthreads = nthreads < chunk ? nthreads : chunk;
+    chunk = (nbAct + mp->nthreads - 1) / mp->nthreads;
+    chunk = (chunk + per_line - 1) / per_line * per_line;
+    mp->nthreads = (nbAct + chunk - 1) / chunk;
+    for ( i = 0 ; i <= mp->nthreads ; i++ )
+    {
+        mp->rows[i] = i * chunk < nbAct ? i * chunk : nbAct;
+    }
+
+    for ( i = 0 ; i < N_MODAL_KERNELS ; i++ )
+    {
+        if ((!automatic && strcmp(requested, modal_kernels[i].name) != 0) ||
+            !cpu_feature_supported(modal_kernels[i].cpu_feature))
+        {
+            continue;
+        }
+        if (verify_modal_kernel(mp, modal_kernels[i].kernel) != 0)
+        {
+            printf("ALPAO %s: %s modal kernel does not match the reference product; skipping.\n",
+                   serial, modal_kernels[i].name);
+            continue;
+        }
+        break;
+    }
+    if (i == N_MODAL_KERNELS)
+    {
+        // scalar kernel is always last
+        i = N_MODAL_KERNELS - 1;
+    }
+    mp->kernel = modal_kernels[i].kernel;
+    printf("ALPAO %s: expanding %d modes to %d actuators with the %s kernel on %d thread%s.\n",
+           serial, mp->nmodes, nbAct, modal_kernels[i].name, mp->nthreads,
+           mp->nthreads > 1 ? "s" : "");
+    return mp;
+}
+
+void free_modal_product(modalProduct * mp)
+{
+    if (mp != NULL)
+    {
+        free(mp->matrix);
+        free(mp->coeffs);
+        free(mp->out);
+        free(mp);
+    }
+}
+
+/* Expand this frame's coefficients; returns the actuator values */
+static inline const Scalar * modal_product(modalProduct * mp, const void * image)
+{
+    int m;
+    uint64_t frame;
+
+    for ( m = 0 ; m < mp->nmodes ; m++ )
+    {
+        mp->coeffs[m] = load_input(image, mp->dtype, m, mp->input_scale);
+    }
+    if (mp->nthreads == 1)
+    {
+        mp->kernel(mp->matrix, mp->stride, mp->coeffs, mp->out, 0, mp->nbAct);
+        return mp->out;
+    }
+
+    frame = __atomic_add_fetch(&mp->frame, 1, __ATOMIC_RELEASE);
+    if (mp->wait_sem)
+    {
+        for ( m = 1 ; m < mp->nthreads ; m++ )
+        {
+            sem_post(&mp->go[m]);
+        }
+    }
+    mp->kernel(mp->matrix, mp->stride, mp->coeffs, mp->out, mp->rows[0], mp->rows[1]);
+    while (__atomic_load_n(&mp->done, __ATOMIC_ACQUIRE) < frame * (mp->nthreads - 1))
+    {
+        cpu_relax();
+    }
+    return mp->out;
+}
+
+/* Convert the input image into buf, ready for send_frame() */
+static inline void convert_frame(const IMAGE * SMimage, commandBuffers * buf, convertKernel convert,
+                                 const calibrationSet * calib, struct timespec * converted)
+{
+    // kernels only set mask entries, so clear whatever this buffer's last frame flagged
+    if (buf->nsat > 0)
+    {
+        memset(buf->satmask, 0, buf->nbAct);
+    }
+    if (calib->conv.direct)
+    {
+        direct_frame(SMimage, buf);
+    } else if (calib->modal != NULL)
+    {
+        buf->nsat = convert(modal_product(calib->modal, SMimage[0].array.raw), NULL, buf->dminputs,
+                            buf->satmask, buf->nbAct, &calib->conv);
+        buf->input = SMimage[0].array.raw;
+    } else if (calib->conv.gather == GATHER_PLAN)
+    {
+        buf->nsat = convert(plan_gather(&calib->plan, SMimage[0].array.raw), NULL, buf->dminputs,
+                            buf->satmask, buf->nbAct, &calib->conv);
+        buf->input = SMimage[0].array.raw;
+    } else
+    {
+        buf->nsat = convert(SMimage[0].array.raw, calib->mapping, buf->dminputs, buf->satmask,
+                            buf->nbAct, &calib->conv);
+        buf->input = SMimage[0].array.raw;
+    }
+    clock_gettime(CLOCK_REALTIME, converted);
+
+    //for (idx = 0; idx < nbAct; idx++) {
+    //    printf("Act %d: %f\n", idx, dminputs[idx]);
+    //} 
+}
+
+/* Send a converted command to the mirror and account for it. lastsat is
+the clip count of the previous command sent. Returns 0 without sending
+when a --sync round drops the frame. */
+int send_frame(asdkDM * dm, commandBuffers * buf, int lastsat, saturationStats * sat,
+               latencyStats * lat, commandTelemetry * tel, dmSync * sync, const char * serial)
+{
+    COMPL_STAT ret;
+
+    // with --sync, send together with the other mirrors or not at all
+    if (sync != NULL)
+    {
+        int arrived = sync_arrive(sync);
+
+        if (arrived <= 0)
+        {
+            return arrived;
+        }
+        sync_issued(sync, monotonic_ns());
+    }
+
+    /* Finally, send the command to the DM */
+    clock_gettime(CLOCK_REALTIME, &lat->sending);
+    ret = asdkSend(dm, buf->command);
+    // --direct: the slice may have been rewritten while the driver read it
+    if (ret != -1 && buf->ring != NULL && direct_lapped(buf->ring, buf->ring_cnt0))
+    {
+        direct_copy(buf->ring, buf);
+        ret = asdkSend(dm, buf->command);
+        buf->nresent++;
+    }
+    buf->ring = NULL;
+    clock_gettime(CLOCK_REALTIME, &lat->sent);
+    buf->nframes++;
+
+    publish_command(tel, buf->command, lat);
+    if (tel->rec != NULL)
+    {
+        record_frame(tel->rec, tel->published, buf, lat);
+    }
+    tel->published++;
+    latency_record_frame(lat);
+    record_saturation(sat, buf, lastsat, serial);
+
+    return ret;
+}
+
+/* Send command to mirror from shared memory */
+int sendCommand(asdkDM * dm, IMAGE * SMimage, commandBuffers * buf, convertKernel convert,
+                const calibrationSet * calib, saturationStats * sat, latencyStats * lat, commandTelemetry * tel, dmSync * sync,
+                const char * serial)
+{
+    int lastsat = buf->nsat;
+
+    convert_frame(SMimage, buf, convert, calib, &lat->converted);
+    return send_frame(dm, buf, lastsat, sat, lat, tel, sync, serial);
+}
+
+/* Run-time options for the control loop, filled in from the command line */
+typedef struct
+{
+    int nobias, nonorm, fractional;
+    const char * kernel; // conversion kernel name, NULL to choose automatically
+    double satlog;       // minimum seconds between saturation log messages
+    int rtprio;          // SCHED_FIFO priority, 0 to keep the default scheduler
+    int cpu;             // core to pin the loop to, -1 to leave affinity alone
+    int mlock;           // lock all current and future memory
+    int wait_mode;       // WAIT_SEM, WAIT_SPIN or WAIT_HYBRID
+    double spin_us;      // hybrid spin budget
+    int coalesce;        // send only the newest frame of any backlog
+    int nchannels;       // virtual DM channels, 0 to read the input image directly
+    unsigned long resum_interval; // virtual DM: combines between full re-sums
+    int sync;            // several DMs: send each frame together
+    double sync_timeout_us;
+    int sync_cnt2;       // sync: frame IDs from the producers' md.cnt2
+    int pipeline;        // convert and send in separate threads
+    int sender_cpu;      // pipeline: core for the sender thread
+    int telemetry_depth; // slices in <shm_name>_cmd, 0 to not publish it
+    const char * record_prefix; // record every frame to <prefix>_<serial>_*.bin
+    unsigned long record_ring;  // records buffered between the loop and the disk
+    unsigned long record_chunk; // records per file
+    int reload;          // swap in calibration files as they change
+    int dtype;           // INPUT_* of the input image, -1 to follow an existing image
+    double input_scale;  // int16 inputs: units per count
+    int direct;          // input is a ring of ready commands, sent without conversion
+    int vector;          // input is an nbAct x 1 vector in actuator order, not a map-sized image
+    int gather;          // GATHER_INDEX, GATHER_PLAN or GATHER_AUTO to benchmark at startup
+    int modal;           // input is modal coefficients, expanded by <serial>_modes.fits
+    int modal_threads;   // threads sharing the modal product, the loop's included
+    const int * modal_cpus; // cores for the modal_threads - 1 helpers, or NULL
+} loopOptions;
+
+/* How the control loop waits for the next frame:
+WAIT_SEM     block on the semaphore (default; every post is a frame)
+WAIT_SPIN    spin on the images' cnt0 counters, for an isolated core
+WAIT_HYBRID  spin for a budget, then fall back to the semaphore
+In the spinning modes a frame is a change of cnt0 with the write flag
+clear, so stale semaphore posts left behind while spinning only cost an
+extra check when the hybrid mode does block.
+
+The waiter watches either the single input image or every channel of a
+virtual DM. With several channels there is no single semaphore to block
+on, so one watcher thread per channel waits on that channel's semaphore
+and posts anypost, which is what the loop blocks on instead. The
+watchers run at the loop's priority on the loop's core, so a wake is
+not held up by other work and doesn't migrate between cores. At the same
+SCHED_FIFO priority, a watcher can't preempt the hybrid mode's spin and
+only catches up once the loop blocks. The spinning modes check every
+channel's cnt0 from the loop thread itself, and WAIT_SPIN starts no
+watchers at all.
+
+With coalescing on, only the newest frame is ever sent: in WAIT_SEM mode
+the posts that queued up while the last command was going out are
+drained after waking, and the spinning modes skip any cnt0 values they
+didn't see. Either way the frames passed over are counted in skipped. */
+enum { WAIT_SEM, WAIT_SPIN, WAIT_HYBRID };
+
+static const char * wait_mode_names[] = {"sem", "spin", "hybrid"};
+
+#define MAX_CHANNELS 16
+
+typedef struct
+{
+    int mode;
+    int64_t spin_ns;       // hybrid: spin budget before blocking
+    int coalesce;          // send only the newest of any backlog
+    int nimages;           // the input image, or the virtual DM channels
+    IMAGE * images[MAX_CHANNELS];
+    uint64_t lastcnt[MAX_CHANNELS]; // cnt0 of the last frame handled, per image
+    uint64_t frame_id;     // writes to the images since the wait started
+    int fired;             // image whose new frame ended the last wait
+    sem_t * anypost;       // with several images: posted on any of their semaphores
+    unsigned long spun;    // frames caught while spinning
+    unsigned long blocked; // frames that needed the semaphore
+    unsigned long skipped; // frames passed over by coalescing
+} frameWaiter;
+
+void init_frame_waiter(frameWaiter * w, const loopOptions * opts, IMAGE ** images, int nimages,
+                       sem_t * anypost)
+{
+    int i;
+
+    memset(w, 0, sizeof(frameWaiter));
+    w->mode = opts->wait_mode;
+    w->spin_ns = (int64_t)(opts->spin_us * 1e3);
+    w->coalesce = opts->coalesce;
+    w->nimages = nimages;
+    w->anypost = anypost;
+    for ( i = 0 ; i < nimages ; i++ )
+    {
+        w->images[i] = images[i];
+        w->lastcnt[i] = images[i][0].md[0].cnt0;
+    }
+}
+
+// a new frame is ready once cnt0 has moved and the producer is done writing
+static inline int frame_ready(frameWaiter * w)
+{
+    int i;
+    const IMAGE * SMimage;
+
+    for ( i = 0 ; i < w->nimages ; i++ )
+    {
+        SMimage = w->images[i];
+        if (__atomic_load_n(&SMimage[0].md[0].cnt0, __ATOMIC_ACQUIRE) != w->lastcnt[i] &&
+            __atomic_load_n(&SMimage[0].md[0].write, __ATOMIC_ACQUIRE) == 0)
+        {
+            w->fired = i;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// take the frames a wait found, counting any cnt0 values it missed
+static inline void take_frame(frameWaiter * w)
+{
+    int i;
+    uint64_t cnt0;
+
+    for ( i = 0 ; i < w->nimages ; i++ )
+    {
+        cnt0 = w->images[i][0].md[0].cnt0;
+        if (w->coalesce && cnt0 - w->lastcnt[i] > 1)
+        {
+            w->skipped += cnt0 - w->lastcnt[i] - 1;
+        }
+        w->frame_id += cnt0 - w->lastcnt[i];
+        w->lastcnt[i] = cnt0;
+    }
+}
+
+// block until the semaphore for the watched images is posted
+static inline void block_for_post(frameWaiter * w)
+{
+    if (w->nimages == 1)
+    {
+        ImageStreamIO_semwait(w->images[0], 0);
+    } else
+    {
+        sem_wait(w->anypost);
+    }
+}
+
+// drain posts that queued up behind the one just taken
+static inline unsigned long drain_posts(frameWaiter * w)
+{
+    unsigned long drained = 0;
+
+    if (w->nimages == 1)
+    {
+        while (ImageStreamIO_semtrywait(w->images[0], 0) == 0)
+        {
+            drained++;
+        }
+    } else
+    {
+        while (sem_trywait(w->anypost) == 0)
+        {
+            drained++;
+        }
+    }
+    return drained;
+}
+
+/* Wait for the next frame. Returns as soon as one is ready, or when stop
+is set (the caller checks stop before sending). */
+void wait_for_frame(frameWaiter * w)
+{
+    int64_t deadline;
+
+    if (w->mode == WAIT_SEM && w->nimages == 1)
+    {
+        block_for_post(w);
+        if (w->coalesce)
+        {
+            // everything still queued is older than what's in the buffer now
+            w->skipped += drain_posts(w);
+        }
+        w->frame_id += w->images[0][0].md[0].cnt0 - w->lastcnt[0];
+        w->lastcnt[0] = w->images[0][0].md[0].cnt0;
+        w->fired = 0;
+        w->blocked++;
+        return;
+    }
+
+    if (w->mode != WAIT_SEM)
+    {
+        deadline = monotonic_ns() + w->spin_ns;
+        while (!stop)
+        {
+            if (frame_ready(w))
+            {
+                take_frame(w);
+                w->spun++;
+                return;
+            }
+            cpu_relax();
+            if (w->mode == WAIT_HYBRID && monotonic_ns() >= deadline)
+            {
+                break;
+            }
+        }
+    }
+
+    // block, skipping wakes from stale posts
+    while (!stop)
+    {
+        block_for_post(w);
+        if (frame_ready(w))
+        {
+            if (w->coalesce && w->nimages > 1)
+            {
+                drain_posts(w);
+            }
+            take_frame(w);
+            w->blocked++;
+            return;
+        }
+    }
+}
+
+/* Frame ID for --sync: the producer's frame number in md.cnt2 of the image
+that ended the wait, or the writes counted since the wait started. */
+static inline uint64_t sync_frame_id(const frameWaiter * w, int producer_ids)
+{
+    if (producer_ids)
+    {
+        return w->images[w->fired][0].md[0].cnt2;
+    }
+    return w->frame_id;
+}
+
+/* Unblock a wait_for_frame() running in another thread, so it sees stop */
+void wake_frame_waiter(frameWaiter * w)
+{
+    if (w->mode == WAIT_SPIN)
+    {
+        return; // checks stop as it spins
+    }
+    if (w->nimages == 1)
+    {
+        ImageStreamIO_sempost(w->images[0], 0);
+    } else
+    {
+        sem_post(w->anypost);
+    }
+}
+
+/* Apply the real-time options: SCHED_FIFO priority, CPU affinity and
+memory locking. Each one that fails is reported and the loop runs
+without it rather than refusing to start. The priority and affinity
+apply to the calling thread (the mirror's loop); the memory lock covers
+the whole process. */
+void setup_realtime(const char * serial, const loopOptions * opts)
+{
+    struct sched_param param;
+    cpu_set_t cpuset;
+    int err;
+
+    if (opts->mlock)
+    {
+        if (mlockall(MCL_CURRENT | MCL_FUTURE) == 0)
+        {
+            printf("ALPAO %s: locked all memory.\n", serial);
+        } else
+        {
+            printf("ALPAO %s: could not lock memory: %s\n", serial, strerror(errno));
+        }
+    }
+
+    if (opts->cpu >= 0)
+    {
+        CPU_ZERO(&cpuset);
+        CPU_SET(opts->cpu, &cpuset);
+        err = pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+        if (err == 0)
+        {
+            printf("ALPAO %s: pinned to CPU %d.\n", serial, opts->cpu);
+        } else
+        {
+            printf("ALPAO %s: could not pin to CPU %d: %s\n", serial, opts->cpu, strerror(err));
+        }
+    }
+
+    if (opts->rtprio > 0)
+    {
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = opts->rtprio;
+        err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (err == 0)
+        {
+            printf("ALPAO %s: running SCHED_FIFO at priority %d.\n", serial, opts->rtprio);
+        } else
+        {
+            printf("ALPAO %s: could not set SCHED_FIFO priority %d: %s\n", serial, opts->rtprio,
+                   strerror(err));
+        }
+    }
+}
+
+/* Multiplexed virtual DM. Independent producers (AO loop, NCPA offsets,
+flat, probes, ...) each write their own channel stream <shm_name>_00,
+<shm_name>_01, ... with the same geometry as the input image. Whenever
+any channel posts, the channels are summed into the <shm_name> image,
+which is then converted and sent as usual, and posted so other
+processes can see the combined command.
+
+Typically one channel (the AO loop) changes every frame and the rest
+change rarely, so the sum is kept up to date incrementally: each
+channel's last applied contents are cached, and a channel whose cnt0
+moved only adds its difference from the cache to the running sum. The
+per-frame cost then depends on how many channels changed, not on how
+many there are. Rounding error in the running sum is bounded by
+re-summing all channels from scratch every resum_interval combines. */
+typedef void (*sumKernel)(float * out, const float * const * in, int nin, int npix);
+typedef void (*deltaKernel)(float * sum, float * prev, const float * in, int npix);
+
+typedef struct
+{
+    IMAGE * channel;
+    sem_t * anypost;
+    const char * serial;
+    int index;
+    int rtprio;              // the loop's scheduling, for the watcher thread
+    int cpu;
+} channelWatch;
+
+typedef struct
+{
+    int nchannels;
+    IMAGE * channels[MAX_CHANNELS];
+    int npix;
+    sem_t anypost;                    // WAIT_SEM/WAIT_HYBRID: posted by the watchers
+    pthread_t watchers[MAX_CHANNELS];
+    channelWatch watches[MAX_CHANNELS];
+    int nwatchers;
+    sumKernel sum;
+    deltaKernel delta;
+    float * total;                    // running sum of the channels
+    float * prev[MAX_CHANNELS];       // channel contents included in total
+    uint64_t lastcnt[MAX_CHANNELS];   // channel cnt0 when prev was taken
+    unsigned long resum_interval;     // combines between full re-sums, 0 for always
+    unsigned long since_resum;
+    unsigned long nresums;
+    unsigned long ndeltas;            // channel updates applied incrementally
+} virtualDM;
+
+void sum_channels_scalar(float * out, const float * const * in, int nin, int npix)
+{
+    int c, idx;
+
+    for ( idx = 0 ; idx < npix ; idx++ )
+    {
+        out[idx] = in[0][idx];
+    }
+    for ( c = 1 ; c < nin ; c++ )
+    {
+        for ( idx = 0 ; idx < npix ; idx++ )
+        {
+            out[idx] += in[c][idx];
+        }
+    }
+}
+
+// total += in - prev; prev = in
+void apply_delta_scalar(float * total, float * prev, const float * in, int npix)
+{
+    int idx;
+    float cur;
+
+    for ( idx = 0 ; idx < npix ; idx++ )
+    {
+        cur = in[idx];
+        total[idx] += cur - prev[idx];
+        prev[idx] = cur;
+    }
+}
+
+#ifdef HAVE_X86_SIMD
+/* Channel sums, 8 (AVX2) or 4 (SSE2) pixels at a time. Each block of
+pixels is accumulated across all channels in a register before it is
+stored, so the output is written once per frame whatever the channel
+count. */
+__attribute__((target("avx2")))
+void sum_channels_avx2(float * out, const float * const * in, int nin, int npix)
+{
+    int c, idx;
+    __m256 acc;
+
+    for ( idx = 0 ; idx + 8 <= npix ; idx += 8 )
+    {
+        acc = _mm256_loadu_ps(&in[0][idx]);
+        for ( c = 1 ; c < nin ; c++ )
+        {
+            acc = _mm256_add_ps(acc, _mm256_loadu_ps(&in[c][idx]));
+        }
+        _mm256_storeu_ps(&out[idx], acc);
+    }
+    for ( ; idx < npix ; idx++ )
+    {
+        out[idx] = in[0][idx];
+        for ( c = 1 ; c < nin ; c++ )
+        {
+            out[idx] += in[c][idx];
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+void apply_delta_avx2(float * total, float * prev, const float * in, int npix)
+{
+    int idx;
+    __m256 cur;
+
+    for ( idx = 0 ; idx + 8 <= npix ; idx += 8 )
+    {
+        cur = _mm256_loadu_ps(&in[idx]);
+        _mm256_storeu_ps(&total[idx], _mm256_add_ps(_mm256_loadu_ps(&total[idx]),
+                                                    _mm256_sub_ps(cur, _mm256_loadu_ps(&prev[idx]))));
+        _mm256_storeu_ps(&prev[idx], cur);
+    }
+    apply_delta_scalar(&total[idx], &prev[idx], &in[idx], npix - idx);
+}
+
+__attribute__((target("sse2")))
+void sum_channels_sse2(float * out, const float * const * in, int nin, int npix)
+{
+    int c, idx;
+    __m128 acc;
+
+    for ( idx = 0 ; idx + 4 <= npix ; idx += 4 )
+    {
+        acc = _mm_loadu_ps(&in[0][idx]);
+        for ( c = 1 ; c < nin ; c++ )
+        {
+            acc = _mm_add_ps(acc, _mm_loadu_ps(&in[c][idx]));
+        }
+        _mm_storeu_ps(&out[idx], acc);
+    }
+    for ( ; idx < npix ; idx++ )
+    {
+        out[idx] = in[0][idx];
+        for ( c = 1 ; c < nin ; c++ )
+        {
+            out[idx] += in[c][idx];
+        }
+    }
+}
+
+__attribute__((target("sse2")))
+void apply_delta_sse2(float * total, float * prev, const float * in, int npix)
+{
+    int idx;
+    __m128 cur;
+
+    for ( idx = 0 ; idx + 4 <= npix ; idx += 4 )
+    {
+        cur = _mm_loadu_ps(&in[idx]);
+        _mm_storeu_ps(&total[idx], _mm_add_ps(_mm_loadu_ps(&total[idx]),
+                                              _mm_sub_ps(cur, _mm_loadu_ps(&prev[idx]))));
+        _mm_storeu_ps(&prev[idx], cur);
+    }
+    apply_delta_scalar(&total[idx], &prev[idx], &in[idx], npix - idx);
+}
+#endif
+
+void select_combine_kernels(virtualDM * vdm)
+{
+    vdm->sum = sum_channels_scalar;
+    vdm->delta = apply_delta_scalar;
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        vdm->sum = sum_channels_avx2;
+        vdm->delta = apply_delta_avx2;
+    } else if (__builtin_cpu_supports("sse2"))
+    {
+        vdm->sum = sum_channels_sse2;
+        vdm->delta = apply_delta_sse2;
+    }
+#endif
+}
+
+// WAIT_SEM/WAIT_HYBRID: forward each post on a channel to anypost
+void * watch_channel(void * arg)
+{
+    channelWatch * watch = (channelWatch *) arg;
+    loopOptions rt;
+    char label[MAX_STRLEN];
+
+    memset(&rt, 0, sizeof(rt));
+    rt.rtprio = watch->rtprio;
+    rt.cpu = watch->cpu;
+    snprintf(label, MAX_STRLEN, "%s channel %d watcher", watch->serial, watch->index);
+    setup_realtime(label, &rt);
+
+    while (!stop)
+    {
+        ImageStreamIO_semwait(watch->channel, 0);
+        sem_post(watch->anypost);
+    }
+    return NULL;
+}
+
+void free_virtual_dm(virtualDM * vdm)
+{
+    int c;
+
+    // watchers are blocked in sem_wait, a cancellation point
+    for ( c = 0 ; c < vdm->nwatchers ; c++ )
+    {
+        pthread_cancel(vdm->watchers[c]);
+        pthread_join(vdm->watchers[c], NULL);
+    }
+    for ( c = 0 ; c < vdm->nchannels ; c++ )
+    {
+        free(vdm->channels[c]);
+        free(vdm->prev[c]);
+    }
+    free(vdm->total);
+}
+
+/* Create (or reuse) and connect to the channel streams, and start the
+watcher threads if the loop is going to block on them */
+int init_virtual_dm(virtualDM * vdm, const char * serial, const char * shm_name,
+                    const int * axes, const loopOptions * opts)
+{
+    int nchannels = opts->nchannels;
+    char channel_name[MAX_STRLEN];
+    int c;
+
+    if (nchannels > MAX_CHANNELS)
+    {
+        printf("ALPAO %s: at most %d virtual DM channels are supported\n", serial, MAX_CHANNELS);
+        return -1;
+    }
+
+    vdm->nchannels = nchannels;
+    vdm->npix = axes[0] * axes[1];
+    vdm->nwatchers = 0;
+    vdm->resum_interval = opts->resum_interval;
+    vdm->since_resum = 0;
+    vdm->nresums = 0;
+    vdm->ndeltas = 0;
+    // so a failure part way through can free what was set up
+    memset(vdm->channels, 0, sizeof(vdm->channels));
+    memset(vdm->prev, 0, sizeof(vdm->prev));
+    select_combine_kernels(vdm);
+    if (posix_memalign((void **) &vdm->total, CACHE_LINE, vdm->npix * sizeof(float)) != 0)
+    {
+        printf("ALPAO %s: could not allocate the virtual DM sum\n", serial);
+        return -1;
+    }
+    for ( c = 0 ; c < nchannels ; c++ )
+    {
+        snprintf(channel_name, MAX_STRLEN, "%s_%02d", shm_name, c);
+        initializeSharedMemory(channel_name, axes[0], axes[1], INPUT_FLOAT);
+        vdm->channels[c] = (IMAGE*) malloc(sizeof(IMAGE));
+        ImageStreamIO_read_sharedmem_image_toIMAGE(channel_name, vdm->channels[c]);
+        // the initial zeroing post is not a command
+        ImageStreamIO_semflush(vdm->channels[c], -1);
+        if (posix_memalign((void **) &vdm->prev[c], CACHE_LINE, vdm->npix * sizeof(float)) != 0)
+        {
+            printf("ALPAO %s: could not allocate the virtual DM channel cache\n", serial);
+            free_virtual_dm(vdm);
+            return -1;
+        }
+    }
+
+    if (nchannels > 1 && opts->wait_mode != WAIT_SPIN)
+    {
+        sem_init(&vdm->anypost, 0, 0);
+        for ( c = 0 ; c < nchannels ; c++ )
+        {
+            vdm->watches[c].channel = vdm->channels[c];
+            vdm->watches[c].anypost = &vdm->anypost;
+            vdm->watches[c].serial = serial;
+            vdm->watches[c].index = c;
+            vdm->watches[c].rtprio = opts->rtprio;
+            vdm->watches[c].cpu = opts->cpu;
+            if (pthread_create(&vdm->watchers[c], NULL, watch_channel, &vdm->watches[c]) != 0)
+            {
+                printf("ALPAO %s: could not start watcher for channel %d\n", serial, c);
+                free_virtual_dm(vdm);
+                return -1;
+            }
+            vdm->nwatchers++;
+        }
+    }
+
+    printf("ALPAO %s: virtual DM with %d channels %s_00 .. %s_%02d.\n",
+           serial, nchannels, shm_name, shm_name, nchannels - 1);
+    return 0;
+}
+
+/* Rebuild the running sum from scratch, from a snapshot of every channel */
+void resum_channels(virtualDM * vdm)
+{
+    int c;
+
+    for ( c = 0 ; c < vdm->nchannels ; c++ )
+    {
+        vdm->lastcnt[c] = __atomic_load_n(&vdm->channels[c][0].md[0].cnt0, __ATOMIC_ACQUIRE);
+        memcpy(vdm->prev[c], vdm->channels[c][0].array.F, vdm->npix * sizeof(float));
+    }
+    vdm->sum(vdm->total, (const float * const *) vdm->prev, vdm->nchannels, vdm->npix);
+    vdm->since_resum = 0;
+    vdm->nresums++;
+}
+
+/* Bring the running sum up to date with the channels that changed, copy
+it into the combined image and post it */
+void combine_channels(virtualDM * vdm, IMAGE * SMimage)
+{
+    uint64_t cnt0;
+    int c;
+
+    if (vdm->since_resum >= vdm->resum_interval)
+    {
+        resum_channels(vdm);
+    } else
+    {
+        for ( c = 0 ; c < vdm->nchannels ; c++ )
+        {
+            cnt0 = __atomic_load_n(&vdm->channels[c][0].md[0].cnt0, __ATOMIC_ACQUIRE);
+            if (cnt0 != vdm->lastcnt[c])
+            {
+                vdm->lastcnt[c] = cnt0;
+                vdm->delta(vdm->total, vdm->prev[c], vdm->channels[c][0].array.F, vdm->npix);
+                vdm->ndeltas++;
+            }
+        }
+        vdm->since_resum++;
+    }
+
+    SMimage[0].md[0].write = 1;
+    memcpy(SMimage[0].array.F, vdm->total, vdm->npix * sizeof(float));
+    SMimage[0].md[0].write = 0;
+    SMimage[0].md[0].cnt0++;
+    SMimage[0].md[0].cnt1++;
+    clock_gettime(CLOCK_REALTIME, &SMimage[0].md[0].writetime);
+    ImageStreamIO_sempost(&SMimage[0], -1);
+}
+
+/* Hot reload of the calibration (--reload). A background thread watches
+ALPAO_CALIB with inotify for writes to, or renames onto, this DM's
+<serial>_userconfig.txt and <serial>_actuator_mapping.fits. Once the
+files have been quiet for CALIB_SETTLE_NS it loads them (refreshing the
+cache), checks the result against the DM and the input image, and
+builds a new calibrationSet, gather plan included. The set is handed to
+the loop through a single pointer that the loop checks once per frame,
+between frames, so the swap costs the loop one atomic load. The loop
+hands the set it replaced back through a second pointer; the reloader
+frees it, so only one new set is ever in flight and the loop never calls
+free(). A calibration that fails to parse or validate is reported and
+the loop keeps the one it has. */
+#define CALIB_SETTLE_NS 100000000  // 100 ms with no further events
+#define CALIB_POLL_MS 50
+
+typedef struct
+{
+    const char * serial;
+    int nbAct;
+    int axes[2];              // input image axes, which a new map must match
+    int vector;               // input in actuator order: the map is not used
+    conversionParams flags;   // session flags, copied into every set
+    char names[2][MAX_STRLEN];// the watched file names
+    int fd;                   // inotify instance
+    calibrationSet * pending; // reloader -> loop
+    calibrationSet * retired; // loop -> reloader
+    int running;
+    pthread_t thread;
+    unsigned long nreloads;
+    unsigned long nrejected;
+} calibReloader;
+
+static void reload_calibration(calibReloader * rl)
+{
+    calibration cal;
+    calibrationSet * set;
+
+    if (load_calibration(rl->serial, &cal) == -1)
+    {
+        printf("ALPAO %s: keeping the current calibration\n", rl->serial);
+        rl->nrejected++;
+        return;
+    }
+    set = NULL;
+    if (check_calibration(rl->serial, &cal, rl->nbAct, rl->axes, rl->vector, &rl->flags) == 0)
+    {
+        set = new_calibration_set(&rl->flags, &cal, rl->nbAct, rl->vector);
+    }
+    free_calibration(&cal);
+    if (set == NULL)
+    {
+        printf("ALPAO %s: keeping the current calibration\n", rl->serial);
+        rl->nrejected++;
+        return;
+    }
+    printf("ALPAO %s: swapping in max_stroke %g, volume_factor %g\n",
+           rl->serial, set->conv.max_stroke, set->conv.volume_factor);
+    __atomic_store_n(&rl->pending, set, __ATOMIC_RELEASE);
+}
+
+void * run_reloader(void * arg)
+{
+    calibReloader * rl = (calibReloader *) arg;
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event * ev;
+    struct pollfd pfd = {rl->fd, POLLIN, 0};
+    calibrationSet * retired;
+    int64_t changed = 0;  // time of the last relevant event, 0 if none
+    int inflight = 0;     // a set was published and the loop has not handed back the old one
+    ssize_t len;
+    char * p;
+
+    while (__atomic_load_n(&rl->running, __ATOMIC_ACQUIRE))
+    {
+        if (poll(&pfd, 1, CALIB_POLL_MS) > 0)
+        {
+            len = read(rl->fd, events, sizeof(events));
+            for ( p = events ; len > 0 && p < events + len ; p += sizeof(struct inotify_event) + ev->len )
+            {
+                ev = (const struct inotify_event *) p;
+                if (ev->len > 0 &&
+                    (strcmp(ev->name, rl->names[0]) == 0 || strcmp(ev->name, rl->names[1]) == 0))
+                {
+                    changed = monotonic_ns();
+                }
+            }
+        }
+
+        // the loop has switched over: free what it was using
+        retired = __atomic_exchange_n(&rl->retired, NULL, __ATOMIC_ACQUIRE);
+        if (retired != NULL)
+        {
+            free_calibration_set(retired);
+            rl->nreloads++;
+            inflight = 0;
+        }
+
+        // wait for editors to finish writing, and for the last swap to complete
+        if (changed != 0 && !inflight && monotonic_ns() - changed > CALIB_SETTLE_NS)
+        {
+            changed = 0;
+            reload_calibration(rl);
+            inflight = __atomic_load_n(&rl->pending, __ATOMIC_RELAXED) != NULL;
+        }
+    }
+    return NULL;
+}
+
+int start_reloader(calibReloader * rl, const char * serial, int nbAct, const int * axes,
+                   int vector, const conversionParams * flags)
+{
+    char dir[MAX_STRLEN*3];
+    char path[MAX_STRLEN*3];
+    pthread_attr_t attr;
+    int n;
+    const char * suffixes[2] = {"_userconfig.txt", "_actuator_mapping.fits"};
+
+    memset(rl, 0, sizeof(calibReloader));
+    rl->serial = serial;
+    rl->nbAct = nbAct;
+    rl->axes[0] = axes[0];
+    rl->axes[1] = axes[1];
+    rl->vector = vector;
+    rl->flags = *flags;
+    for ( n = 0 ; n < 2 ; n++ )
+    {
+        if (calibration_path(serial, suffixes[n], path, sizeof(path)) == -1)
+        {
+            return -1;
+        }
+        snprintf(rl->names[n], MAX_STRLEN, "%s", strrchr(path, '/') + 1);
+    }
+    snprintf(dir, sizeof(dir), "%s", getenv("ALPAO_CALIB"));
+
+    rl->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (rl->fd == -1 || inotify_add_watch(rl->fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) == -1)
+    {
+        printf("ALPAO %s: could not watch %s for calibration changes: %s\n", serial, dir,
+               strerror(errno));
+        if (rl->fd != -1)
+        {
+            close(rl->fd);
+        }
+        return -1;
+    }
+
+    background_thread_attr(&attr);
+    rl->running = 1;
+    if (pthread_create(&rl->thread, &attr, run_reloader, rl) != 0)
+    {
+        printf("ALPAO %s: could not start the calibration reload thread\n", serial);
+        pthread_attr_destroy(&attr);
+        close(rl->fd);
+        return -1;
+    }
+    pthread_attr_destroy(&attr);
+    printf("ALPAO %s: reloading %s and %s from %s on change.\n", serial, rl->names[0],
+           rl->names[1], dir);
+    return 0;
+}
+
+// control thread, between frames: switch to a newly loaded calibration
+static inline calibrationSet * take_calibration(calibReloader * rl, calibrationSet * current)
+{
+    calibrationSet * next = __atomic_load_n(&rl->pending, __ATOMIC_ACQUIRE);
+
+    if (next == NULL)
+    {
+        return current;
+    }
+    __atomic_store_n(&rl->pending, NULL, __ATOMIC_RELAXED);
+    __atomic_store_n(&rl->retired, current, __ATOMIC_RELEASE);
+    return next;
+}
+
+void stop_reloader(calibReloader * rl)
+{
+    __atomic_store_n(&rl->running, 0, __ATOMIC_RELEASE);
+    pthread_join(rl->thread, NULL);
+    close(rl->fd);
+    if (rl->retired != NULL)
+    {
+        rl->nreloads++;
+    }
+    free_calibration_set(rl->pending);
+    free_calibration_set(rl->retired);
+    printf("ALPAO %s: %lu calibration reloads, %lu rejected.\n", rl->serial, rl->nreloads,
+           rl->nrejected);
+}
+
+/* Touch every page of a buffer so the first frames don't take page
+faults. Reads are enough to map shared memory written by someone else. */
+void prefault(const char * serial, const char * what, const void * ptr, size_t nbytes)
+{
+    const volatile char * bytes = (const volatile char *) ptr;
+    long pagesize = sysconf(_SC_PAGESIZE);
+    size_t offset;
+    char sink = 0;
+
+    if (ptr == NULL || nbytes == 0)
+    {
+        return;
+    }
+    for ( offset = 0 ; offset < nbytes ; offset += pagesize )
+    {
+        sink ^= bytes[offset];
+    }
+    sink ^= bytes[nbytes - 1];
+    (void) sink;
+    printf("ALPAO %s: prefaulted %s (%zu bytes).\n", serial, what, nbytes);
+}
+
+// grow the stack by the most the loop is expected to use, while it's cheap
+#define PREFAULT_STACK (256 * 1024)
+__attribute__((noinline)) void prefault_stack(void)
+{
+    volatile char stack[PREFAULT_STACK];
+    memset((char *) stack, 0, PREFAULT_STACK);
+}
+
+// intialize DM and shared memory and enter DM command loop
+/* One mirror driven by the daemon: its own calibration, buffers and
+loop thread. The main thread is the control plane for all of them: it
+handles the signals, asks loops to dump their latency histograms, and
+wakes them to shut down. */
+#define MAX_DMS 8
+
+typedef struct
+{
+    const char * serial;
+    const char * shm_name;
+    loopOptions opts;         // with this mirror's CPU
+    syncGroup * sync;         // --sync: the group this mirror sends with
+    pthread_t thread;
+    volatile sig_atomic_t dump_latency; // SIGUSR1: print the latency histograms
+    pthread_mutex_t wake_lock; // guards SMimage and waiter against the loop exiting
+    IMAGE * SMimage;          // set once the loop is about to wait on the image
+    frameWaiter * waiter;     // set while the loop is waiting for frames
+    int done;                 // the loop has returned
+    int ret;
+} dmController;
+
+void publish_wait_target(dmController * ctl, IMAGE * SMimage, frameWaiter * waiter)
+{
+    pthread_mutex_lock(&ctl->wake_lock);
+    ctl->SMimage = SMimage;
+    ctl->waiter = waiter;
+    pthread_mutex_unlock(&ctl->wake_lock);
+}
+
+// control plane: get a loop blocked on its semaphore to look at stop
+void wake_controller(dmController * ctl)
+{
+    pthread_mutex_lock(&ctl->wake_lock);
+    if (ctl->waiter != NULL)
+    {
+        wake_frame_waiter(ctl->waiter);
+    } else if (ctl->SMimage != NULL)
+    {
+        ImageStreamIO_sempost(ctl->SMimage, 0);
+    }
+    pthread_mutex_unlock(&ctl->wake_lock);
+}
+
+/* Reader/sender pipeline (--pipeline). The loop thread becomes the
+reader: it waits for frames and converts them, and a sender thread
+pushes the commands to the DM, so the next frame is converted while
+the driver is still busy with the last one.
+
+They hand commands over through a latest-value mailbox, a triple
+buffer: the reader fills its back slot and swaps it with the middle
+one, the sender swaps its front slot with the middle one when the
+middle holds a command it hasn't seen. Both swaps are single atomic
+exchanges, so neither side ever waits for the other, and a command the
+sender didn't get to before the next one was published is superseded
+(counted) rather than queued. */
+#define MAILBOX_SLOTS 3
+#define MAILBOX_FRESH 4 // set in middle while its slot holds an unread command
+
+typedef struct
+{
+    commandBuffers buf;
+    struct timespec written, wake, converted;
+    uint64_t frame_id;
+    void * input;             // --record: copy of the input, which may change before the send
+} mailboxSlot;
+
+typedef struct
+{
+    mailboxSlot slots[MAILBOX_SLOTS];
+    int back;                 // reader's slot
+    int front;                // sender's slot
+    int middle __attribute__((aligned(CACHE_LINE)));
+    sem_t posted;             // sem and hybrid waits: posted on every publish
+    unsigned long superseded; // commands replaced before the sender took them
+} commandMailbox;
+
+int init_mailbox(commandMailbox * mb, int nbAct, size_t record_bytes)
+{
+    int i;
+
+    memset(mb, 0, sizeof(commandMailbox));
+    for ( i = 0 ; i < MAILBOX_SLOTS ; i++ )
+    {
+        if (init_command_buffers(&mb->slots[i].buf, nbAct) == -1)
+        {
+            return -1;
+        }
+        if (record_bytes > 0)
+        {
+            mb->slots[i].input = command_alloc(record_bytes);
+            if (mb->slots[i].input == NULL)
+            {
+                return -1;
+            }
+        }
+    }
+    mb->back = 0;
+    mb->middle = 1;
+    mb->front = 2;
+    sem_init(&mb->posted, 0, 0);
+    return 0;
+}
+
+void free_mailbox(commandMailbox * mb)
+{
+    int i;
+
+    for ( i = 0 ; i < MAILBOX_SLOTS ; i++ )
+    {
+        free_command_buffers(&mb->slots[i].buf);
+        free(mb->slots[i].input);
+    }
+    sem_destroy(&mb->posted);
+}
+
+// reader: hand the back slot to the sender and take the middle one to fill next
+static inline void mailbox_publish(commandMailbox * mb)
+{
+    int prev = __atomic_exchange_n(&mb->middle, mb->back | MAILBOX_FRESH, __ATOMIC_ACQ_REL);
+
+    if (prev & MAILBOX_FRESH)
+    {
+        mb->superseded++;
+    }
+    mb->back = prev & ~MAILBOX_FRESH;
+    sem_post(&mb->posted);
+}
+
+// sender: the newest unread command, or NULL if there is none
+static inline mailboxSlot * mailbox_take(commandMailbox * mb)
+{
+    if (!(__atomic_load_n(&mb->middle, __ATOMIC_ACQUIRE) & MAILBOX_FRESH))
+    {
+        return NULL;
+    }
+    mb->front = __atomic_exchange_n(&mb->middle, mb->front, __ATOMIC_ACQ_REL) & ~MAILBOX_FRESH;
+    return &mb->slots[mb->front];
+}
+
+typedef struct
+{
+    commandMailbox mailbox;
+    dmController * ctl;
+    asdkDM * dm;
+    saturationStats * sat;
+    latencyStats * lat;
+    commandTelemetry * tel;
+    dmSync * sync;
+    int lastsat;              // clip count of the last command sent
+    unsigned long heap_allocs;  // allocations the sender made while running
+    pthread_t thread;
+    int ret;
+} senderPipeline;
+
+// sender thread: send every command the reader publishes, newest first
+void * run_sender(void * arg)
+{
+    senderPipeline * snd = (senderPipeline *) arg;
+    dmController * ctl = snd->ctl;
+    const loopOptions * opts = &ctl->opts;
+    commandMailbox * mb = &snd->mailbox;
+    latencyStats * lat = snd->lat;
+    loopOptions rt;
+    char label[MAX_STRLEN];
+    mailboxSlot * slot;
+    int64_t deadline;
+    heapMark heap_start, heap_end;
+
+    // the sender gets the loop's priority on its own core, if one was given
+    rt = *opts;
+    rt.cpu = opts->sender_cpu;
+    rt.mlock = 0;
+    snprintf(label, MAX_STRLEN, "%s sender", ctl->serial);
+    setup_realtime(label, &rt);
+    prefault_stack();
+    heap_mark(&heap_start);
+
+    while (!stop)
+    {
+        slot = mailbox_take(mb);
+        if (slot == NULL)
+        {
+            if (opts->wait_mode == WAIT_SEM)
+            {
+                sem_wait(&mb->posted);
+            } else
+            {
+                deadline = monotonic_ns() + (int64_t)(opts->spin_us * 1e3);
+                while (!stop && !(__atomic_load_n(&mb->middle, __ATOMIC_ACQUIRE) & MAILBOX_FRESH) &&
+                       (opts->wait_mode == WAIT_SPIN || monotonic_ns() < deadline))
+                {
+                    cpu_relax();
+                }
+                if (opts->wait_mode == WAIT_HYBRID &&
+                    !(__atomic_load_n(&mb->middle, __ATOMIC_ACQUIRE) & MAILBOX_FRESH))
+                {
+                    sem_wait(&mb->posted);
+                }
+            }
+            continue;
+        }
+
+        clock_gettime(CLOCK_REALTIME, &lat->picked);
+        lat->written = slot->written;
+        lat->wake = slot->wake;
+        lat->converted = slot->converted;
+        if (snd->sync != NULL)
+        {
+            snd->sync->frame = slot->frame_id;
+        }
+        if (send_frame(snd->dm, &slot->buf, snd->lastsat, snd->sat, lat, snd->tel, snd->sync,
+                       ctl->serial) == -1)
+        {
+            snd->ret = -1;
+            stop = 1; // shut down like a failed loop
+            break;
+        }
+        snd->lastsat = slot->buf.nsat;
+
+        if (ctl->dump_latency && !stop)
+        {
+            print_latency_stats(lat, ctl->serial);
+            ctl->dump_latency = 0;
+        }
+    }
+    heap_mark(&heap_end);
+    snd->heap_allocs = heap_end.allocs - heap_start.allocs;
+    return NULL;
+}
+
+int start_sender(senderPipeline * snd, dmController * ctl, asdkDM * dm, int nbAct,
+                 saturationStats * sat, latencyStats * lat, commandTelemetry * tel, dmSync * sync,
+                 int lastsat, size_t record_bytes)
+{
+    int i;
+
+    if (init_mailbox(&snd->mailbox, nbAct, record_bytes) == -1)
+    {
+        return -1;
+    }
+    snd->heap_allocs = 0;
+    for ( i = 0 ; i < MAILBOX_SLOTS ; i++ )
+    {
+        prefault(ctl->serial, "mailbox slot", snd->mailbox.slots[i].buf.dminputs,
+                 nbAct * sizeof(Scalar));
+    }
+    snd->ctl = ctl;
+    snd->dm = dm;
+    snd->sat = sat;
+    snd->lat = lat;
+    snd->tel = tel;
+    snd->sync = sync;
+    snd->lastsat = lastsat;
+    snd->ret = 0;
+    if (pthread_create(&snd->thread, NULL, run_sender, snd) != 0)
+    {
+        printf("ALPAO %s: could not start the sender thread\n", ctl->serial);
+        return -1;
+    }
+    printf("ALPAO %s: pipelining conversion and sends.\n", ctl->serial);
+    return 0;
+}
+
+/* Called once the reader has stopped; returns the sender's status. The
+mailbox's sends and the sender thread's allocations are added to the
+loop's counts. */
+int stop_sender(senderPipeline * snd, unsigned long * nframes, unsigned long * heap_allocs)
+{
+    int i;
+
+    sem_post(&snd->mailbox.posted);
+    pthread_join(snd->thread, NULL);
+    printf("ALPAO %s: %lu converted commands superseded before the sender took them.\n",
+           snd->ctl->serial, snd->mailbox.superseded);
+    *heap_allocs += snd->heap_allocs;
+    for ( i = 0 ; i < MAILBOX_SLOTS ; i++ )
+    {
+        *nframes += snd->mailbox.slots[i].buf.nframes;
+    }
+    free_mailbox(&snd->mailbox);
+    return snd->ret;
+}
+
+/* --modal-threads: each helper computes its slice of every modal
+product, at the loop's priority */
+void * run_modal_helper(void * arg)
+{
+    modalHelper * h = (modalHelper *) arg;
+    modalProduct * mp = h->mp;
+    loopOptions rt;
+    char label[MAX_STRLEN];
+    uint64_t seen = 0;
+    uint64_t frame;
+
+    memset(&rt, 0, sizeof(rt));
+    rt.rtprio = mp->rtprio;
+    rt.cpu = mp->cpus[h->slice];
+    snprintf(label, MAX_STRLEN, "%s modal helper %d", mp->serial, h->slice);
+    setup_realtime(label, &rt);
+    prefault_stack();
+
+    while (__atomic_load_n(&mp->running, __ATOMIC_ACQUIRE))
+    {
+        if (mp->wait_sem)
+        {
+            sem_wait(&mp->go[h->slice]);
+        }
+        frame = __atomic_load_n(&mp->frame, __ATOMIC_ACQUIRE);
+        if (frame == seen)
+        {
+            cpu_relax();
+            continue;
+        }
+        mp->kernel(mp->matrix, mp->stride, mp->coeffs, mp->out, mp->rows[h->slice],
+                   mp->rows[h->slice + 1]);
+        seen = frame;
+        __atomic_add_fetch(&mp->done, 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+void stop_modal_helpers(modalProduct * mp)
+{
+    int i;
+
+    __atomic_store_n(&mp->running, 0, __ATOMIC_RELEASE);
+    for ( i = 1 ; i < mp->nthreads ; i++ )
+    {
+        sem_post(&mp->go[i]);
+        pthread_join(mp->threads[i], NULL);
+        sem_destroy(&mp->go[i]);
+    }
+}
+
+/* Whether --modal-cpus gives every helper a core of its own: one this
+process may run on, not the loop's or the sender's, and not another
+helper's */
+static int modal_cores_usable(const modalProduct * mp, const loopOptions * opts)
+{
+    cpu_set_t allowed;
+    int i, j, cpu;
+
+    if (opts->modal_cpus == NULL || sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+    {
+        return 0;
+    }
+    for ( i = 1 ; i < mp->nthreads ; i++ )
+    {
+        cpu = opts->modal_cpus[i - 1];
+        if (cpu < 0 || cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, &allowed) ||
+            cpu == opts->cpu || cpu == opts->sender_cpu)
+        {
+            return 0;
+        }
+        for ( j = 1 ; j < i ; j++ )
+        {
+            if (opts->modal_cpus[j - 1] == cpu)
+            {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+int start_modal_helpers(modalProduct * mp, const loopOptions * opts)
+{
+    int i;
+    int pinned = modal_cores_usable(mp, opts);
+
+    mp->rtprio = opts->rtprio;
+    mp->wait_sem = (opts->wait_mode == WAIT_SEM || !pinned);
+    if (opts->wait_mode != WAIT_SEM && !pinned && mp->nthreads > 1)
+    {
+        printf("ALPAO %s: modal helpers have no cores of their own (--modal-cpus); "
+               "they sleep between frames.\n", mp->serial);
+    }
+    for ( i = 1 ; i < mp->nthreads ; i++ )
+    {
+        mp->cpus[i] = pinned ? opts->modal_cpus[i - 1] : -1;
+    }
+    mp->running = 1;
+    for ( i = 1 ; i < mp->nthreads ; i++ )
+    {
+        sem_init(&mp->go[i], 0, 0);
+        mp->helpers[i].mp = mp;
+        mp->helpers[i].slice = i;
+        if (pthread_create(&mp->threads[i], NULL, run_modal_helper, &mp->helpers[i]) != 0)
+        {
+            printf("ALPAO %s: could not start modal helper thread %d\n", mp->serial, i);
+            sem_destroy(&mp->go[i]);
+            mp->nthreads = i;
+            stop_modal_helpers(mp);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int controlLoop(dmController * ctl)
+{
+    const char * serial = ctl->serial;
+    const char * shm_name = ctl->shm_name;
+    const loopOptions * opts = &ctl->opts;
+    int n, idx;
+    UInt nbAct;
+    COMPL_STAT ret;
+    Scalar     tmp;
+    IMAGE * SMimage;
+    conversionParams conv;
+    calibrationSet * calib;
+    calibReloader reloader;
+    int shm_axes[2];
+    commandBuffers cmdbuf;
+    heapMark heap_start, heap_end;
+    unsigned long heap_allocs = 0;
+    convertKernel convert;
+    saturationStats sat;
+    latencyStats lat;
+    commandTelemetry tel;
+    frameWaiter waiter;
+    virtualDM vdm;
+    dmSync mysync;
+    dmSync * sync = NULL;
+    senderPipeline sender;
+    mailboxSlot * slot;
+    calibration cal;
+    modalProduct * modal = NULL;
+    int input_dtype;
+    int result = -1;
+
+    /* get max stroke and volume normalization factor from
+    the user-defined config file, and the actuator map (cached) */
+    if (load_calibration(serial, &cal) == -1)
+    {
+        return -1;
+    }
+    conv.max_stroke = cal.max_stroke;
+    conv.volume_factor = cal.volume_factor;
+    conv.nobias = opts->nobias;
+    conv.nonorm = opts->nonorm;
+    conv.fractional = opts->fractional;
+    conv.input_scale = opts->input_scale;
+    conv.direct = opts->direct;
+
+    //initialize DM
+    asdkDM * dm = NULL;
+    dm = asdkInit(serial);
+    if (dm == NULL)
+    {
+        free_calibration(&cal);
+        return -1;
+    }
+
+    // Get number of actuators
+    ret = asdkGet( dm, "NbOfActuator", &tmp );
+    if (ret == -1)
+    {
+        free_calibration(&cal);
+        goto release_dm;
+    }
+    nbAct = (UInt) tmp;
+
+    /* initialize shared memory image to 0s, in the requested element type
+    or the one an existing image has; a virtual DM sums float channels */
+    if (opts->direct)
+    {
+        if (initializeDirectStream(shm_name, nbAct, DIRECT_DEPTH) == -1)
+        {
+            free_calibration(&cal);
+            goto release_dm;
+        }
+        input_dtype = conv.dtype = INPUT_DOUBLE;
+        printf("ALPAO %s: sending commands directly from %s (%d x 1 x %d doubles).\n",
+               serial, shm_name, nbAct, DIRECT_DEPTH);
+    } else if (opts->modal)
+    {
+        /* an nmodes x 1 vector of coefficients, expanded into double
+        actuator values in actuator order for the conversion kernel */
+        modal = init_modal_product(serial, nbAct, opts->modal_threads, opts->kernel);
+        if (modal == NULL)
+        {
+            free_calibration(&cal);
+            goto release_dm;
+        }
+        shm_axes[0] = modal->nmodes;
+        shm_axes[1] = 1;
+        input_dtype = initializeSharedMemory(shm_name, shm_axes[0], shm_axes[1],
+                                             opts->nchannels > 0 ? INPUT_FLOAT : opts->dtype);
+        modal->dtype = input_dtype;
+        modal->input_scale = opts->input_scale;
+        conv.dtype = INPUT_DOUBLE;
+        printf("ALPAO %s: reading %d %s modal coefficients from %s.\n", serial, shm_axes[0],
+               input_types[input_dtype].name, shm_name);
+    } else
+    {
+        /* the image is the size of the actuator map, or a vector in
+        actuator order with --vector */
+        shm_axes[0] = opts->vector ? (int) nbAct : cal.map_size[0];
+        shm_axes[1] = opts->vector ? 1 : cal.map_size[1];
+        conv.dtype = initializeSharedMemory(shm_name, shm_axes[0], shm_axes[1],
+                                            opts->nchannels > 0 ? INPUT_FLOAT : opts->dtype);
+        input_dtype = conv.dtype;
+        printf("ALPAO %s: reading %dx%d %s inputs from %s%s.\n", serial, shm_axes[0], shm_axes[1],
+               input_types[conv.dtype].name, shm_name, opts->vector ? " in actuator order" : "");
+    }
+
+    /* get actuator mapping from 2D cacao image to 1D vector for
+    ALPAO input, checked against the DM, and compile it into a gather
+    plan */
+    if (!opts->direct &&
+        check_calibration(serial, &cal, nbAct, shm_axes, opts->vector || opts->modal, &conv) == -1)
+    {
+        free_calibration(&cal);
+        goto free_modal;
+    }
+    conv.gather = GATHER_INDEX;
+    calib = new_calibration_set(&conv, &cal, nbAct, opts->vector || opts->direct || opts->modal);
+    free_calibration(&cal);
+    if (calib == NULL)
+    {
+        goto free_modal;
+    }
+    calib->modal = modal;
+
+    // command buffers live for the whole session
+    if (init_command_buffers(&cmdbuf, nbAct) == -1)
+    {
+        goto free_calib;
+    }
+    init_latency_stats(&lat);
+
+    // pick the fastest conversion kernel this CPU runs correctly
+    convert = opts->direct ? NULL : select_convert_kernel(serial, opts->kernel, &conv, nbAct);
+
+    // per-actuator saturation counts and the <shm_name>_sat stream
+    if (init_saturation_stats(&sat, shm_name, nbAct, opts->satlog) == -1)
+    {
+        goto free_buffers;
+    }
+
+    // the commands actually sent, in <shm_name>_cmd and <shm_name>_cmdinfo
+    if (init_command_telemetry(&tel, shm_name, nbAct, opts->telemetry_depth) == -1)
+    {
+        goto free_saturation;
+    }
+
+    // connect to shared memory image (SMimage)
+    SMimage = (IMAGE*) malloc(sizeof(IMAGE));
+    if (SMimage == NULL)
+    {
+        goto free_telemetry;
+    }
+    ImageStreamIO_read_sharedmem_image_toIMAGE(shm_name, &SMimage[0]);
+
+    // Validate SMimage dimensionality and size against DM
+    if (opts->direct) {
+        if (SMimage[0].md[0].naxis != 3 || SMimage[0].md[0].size[0] != nbAct ||
+            SMimage[0].md[0].size[1] != 1 || SMimage[0].md[0].size[2] < 2 ||
+            SMimage[0].md[0].datatype != _DATATYPE_DOUBLE) {
+            printf("ALPAO %s: %s is not a ring of %d-actuator double commands\n",
+                   serial, shm_name, nbAct);
+            goto free_image;
+        }
+    } else if (SMimage[0].md[0].naxis != 2) {
+        printf("SM image naxis = %d\n", SMimage[0].md[0].naxis);
+        goto free_image;
+    } else if (SMimage[0].md[0].size[0] != shm_axes[0]) {
+        printf("SM image size (axis 1) = %d", SMimage[0].md[0].size[0]);
+        goto free_image;
+    } else if (SMimage[0].md[0].size[1] != shm_axes[1]) {
+        printf("SM image size (axis 2) = %d", SMimage[0].md[0].size[1]);
+        goto free_image;
+    }
+
+    /* With a virtual DM, SMimage holds the sum of the channels rather
+    than being written by a producer */
+    if (opts->nchannels > 0)
+    {
+        if (init_virtual_dm(&vdm, serial, shm_name, shm_axes, opts) == -1)
+        {
+            goto free_image;
+        }
+        resum_channels(&vdm);
+        combine_channels(&vdm, SMimage);
+    }
+
+    // --record: every frame to disk, from a writer thread
+    if (opts->record_prefix != NULL)
+    {
+        tel.rec = start_recorder(opts->record_prefix, serial, nbAct, SMimage, opts->record_ring,
+                                 opts->record_chunk);
+        if (tel.rec == NULL)
+        {
+            goto free_vdm;
+        }
+    }
+
+    /* Real-time setup, then fault in everything the loop touches so the
+    first frames don't pay for it */
+    setup_realtime(serial, opts);
+    // block copies or the gather index, whichever converts this image faster
+    if (!opts->direct && !opts->modal)
+    {
+        conv.gather = choose_gather(serial, opts->gather, convert, calib, SMimage[0].array.raw,
+                                    nbAct);
+        calib->conv.gather = conv.gather;
+    }
+
+    prefault(serial, "input image", SMimage[0].array.raw,
+             SMimage[0].md[0].nelement * input_types[input_dtype].size);
+    prefault(serial, "actuator mapping", calib->mapping, nbAct * sizeof(int));
+    prefault(serial, "command buffers", cmdbuf.dminputs, nbAct * sizeof(Scalar));
+    prefault(serial, "saturation stream", sat.stream[0].array.UI32, 2 * nbAct * sizeof(uint32_t));
+    if (tel.cmd != NULL)
+    {
+        prefault(serial, "command telemetry", tel.cmd[0].array.D,
+                 (size_t) nbAct * tel.depth * sizeof(double));
+        prefault(serial, "command timing", tel.info[0].array.UI64,
+                 (size_t) CMDINFO_FIELDS * tel.depth * sizeof(uint64_t));
+    }
+    for ( n = 0 ; n < opts->nchannels ; n++ )
+    {
+        prefault(serial, "virtual DM channel", vdm.channels[n][0].array.F,
+                 vdm.channels[n][0].md[0].nelement * sizeof(float));
+        prefault(serial, "virtual DM channel cache", vdm.prev[n], vdm.npix * sizeof(float));
+    }
+    if (opts->nchannels > 0)
+    {
+        prefault(serial, "virtual DM sum", vdm.total, vdm.npix * sizeof(float));
+    }
+    if (calib->conv.gather == GATHER_PLAN && !calib->plan.identity)
+    {
+        prefault(serial, "gather plan staging", calib->plan.staging,
+                 nbAct * calib->plan.elemsize);
+    }
+    if (modal != NULL)
+    {
+        prefault(serial, "modal matrix", modal->matrix, nbAct * modal->stride * sizeof(double));
+        prefault(serial, "modal coefficients", modal->coeffs, modal->stride * sizeof(double));
+        prefault(serial, "modal product", modal->out, nbAct * sizeof(Scalar));
+        if (start_modal_helpers(modal, opts) == -1)
+        {
+            goto stop_recorder;
+        }
+    }
+    prefault_stack();
+
+    // set DM to all-0 state to begin
+    printf("ALPAO %s: initializing all actuators to 0.\n", serial);
+    publish_wait_target(ctl, SMimage, NULL);
+    ImageStreamIO_semwait(&SMimage[0], 0);
+    latency_wake(&lat, SMimage);
+    //printf("%f\n%f\n", max_stroke, volume_factor);
+    ret = sendCommand(dm, SMimage, &cmdbuf, convert, calib, &sat, &lat, &tel, NULL, serial);
+    if (ret == -1)
+    {
+        goto stop_helpers;
+    }
+
+    // frames are counted from the initial command on
+    if (opts->nchannels > 0)
+    {
+        init_frame_waiter(&waiter, opts, vdm.channels, vdm.nchannels, &vdm.anypost);
+    } else
+    {
+        init_frame_waiter(&waiter, opts, &SMimage, 1, NULL);
+    }
+    publish_wait_target(ctl, SMimage, &waiter);
+    if (ctl->sync != NULL)
+    {
+        mysync.group = ctl->sync;
+        mysync.serial = serial;
+        mysync.producer_ids = opts->sync_cnt2;
+        mysync.offset = 0;
+        mysync.rebase = 0;
+        mysync.behind = 0;
+        sync = &mysync;
+    }
+    if (opts->pipeline &&
+        start_sender(&sender, ctl, dm, nbAct, &sat, &lat, &tel, sync, cmdbuf.nsat,
+                     tel.rec != NULL ? tel.rec->input_bytes : 0) == -1)
+    {
+        goto stop_helpers;
+    }
+    if (opts->reload &&
+        start_reloader(&reloader, serial, nbAct, shm_axes, opts->vector, &conv) == -1)
+    {
+        goto stop_sender;
+    }
+    printf("ALPAO %s: waiting for frames in %s mode.\n", serial, wait_mode_names[waiter.mode]);
+    heap_mark(&heap_start);
+
+    // control loop
+    while (!stop)
+    {
+        //printf("ALPAO %s: waiting on commands.\n", serial);
+        // Wait for the next frame
+        wait_for_frame(&waiter);
+        if (opts->reload)
+        {
+            calib = take_calibration(&reloader, calib);
+        }
+        if (opts->pipeline)
+        {
+            // convert into the mailbox and leave the send to the sender thread
+            slot = &sender.mailbox.slots[sender.mailbox.back];
+            stamp_wake(&slot->wake, &slot->written, waiter.images[waiter.fired]);
+            if (opts->nchannels > 0 && !stop)
+            {
+                combine_channels(&vdm, SMimage);
+            }
+            if (!stop)
+            {
+                convert_frame(SMimage, &slot->buf, convert, calib, &slot->converted);
+                if (slot->input != NULL)
+                {
+                    memcpy(slot->input, slot->buf.input, tel.rec->input_bytes);
+                    slot->buf.input = slot->input;
+                }
+                slot->frame_id = sync_frame_id(&waiter, opts->sync_cnt2);
+                mailbox_publish(&sender.mailbox);
+            }
+            continue;
+        }
+
+        // latency runs from the write of the image (or channel) that woke us
+        latency_wake(&lat, waiter.images[waiter.fired]);
+        if (opts->nchannels > 0 && !stop)
+        {
+            combine_channels(&vdm, SMimage);
+        }
+
+        // Send Command to DM
+        if (!stop) // Skip DM on interrupt signal
+        {
+            //printf("ALPAO %s: sending command with nobias=%d, nonorm=%d, and fractional=%d.\n", serial, nobias, nonorm, fractional);
+            mysync.frame = sync_frame_id(&waiter, opts->sync_cnt2);
+            ret = sendCommand(dm, SMimage, &cmdbuf, convert, calib, &sat, &lat, &tel, sync,
+                              serial);
+            if (ret == -1)
+            {
+                goto stop_reloader;
+            }
+        }
+
+        if (ctl->dump_latency && !stop) // printed below on exit anyway
+        {
+            print_latency_stats(&lat, serial);
+            ctl->dump_latency = 0;
+        }
+    }
+    heap_mark(&heap_end);
+    heap_allocs = heap_end.allocs - heap_start.allocs;
+    result = 0;
+
+    /* Shut down in the reverse order of setup. Failures jump in at the
+    step after the last one that succeeded, with result still -1. */
+stop_reloader:
+    if (opts->reload)
+    {
+        stop_reloader(&reloader);
+    }
+stop_sender:
+    if (result == -1)
+    {
+        stop = 1; // bring the sender and the other DMs down, like a failed loop
+    }
+    publish_wait_target(ctl, NULL, NULL);
+    if (opts->pipeline && stop_sender(&sender, &cmdbuf.nframes, &heap_allocs) == -1)
+    {
+        result = -1;
+    }
+stop_helpers:
+    if (modal != NULL)
+    {
+        stop_modal_helpers(modal);
+    }
+stop_recorder:
+    if (tel.rec != NULL)
+    {
+        stop_recorder(tel.rec, serial);
+    }
+    if (result == 0)
+    {
+        print_latency_stats(&lat, serial);
+        if (waiter.mode != WAIT_SEM)
+        {
+            printf("ALPAO %s: %lu frames caught spinning, %lu after blocking.\n",
+                   serial, waiter.spun, waiter.blocked);
+        }
+        if (waiter.coalesce)
+        {
+            printf("ALPAO %s: %lu stale frames skipped by coalescing.\n", serial, waiter.skipped);
+        }
+
+        // any allocation while the loop ran means the hot path is hitting the heap
+        if (asdkMockHeapAllocs != NULL)
+        {
+            printf("ALPAO %s: sent %lu commands with %lu heap allocations on the loop%s.\n",
+                   serial, cmdbuf.nframes, heap_allocs, opts->pipeline ? " and sender threads" : " thread");
+        } else
+        {
+            printf("ALPAO %s: sent %lu commands; the heap grew by %lld bytes while the loop ran.\n",
+                   serial, cmdbuf.nframes, (long long) heap_end.in_use - (long long) heap_start.in_use);
+        }
+        if (opts->direct)
+        {
+            printf("ALPAO %s: %lu direct commands rewritten during the send, resent from a clipped copy.\n",
+                   serial, cmdbuf.nresent);
+        }
+        if (opts->nchannels > 0)
+        {
+            printf("ALPAO %s: virtual DM applied %lu channel updates incrementally, %lu full re-sums.\n",
+                   serial, vdm.ndeltas, vdm.nresums);
+        }
+    }
+free_vdm:
+    if (opts->nchannels > 0)
+    {
+        free_virtual_dm(&vdm);
+    }
+free_image:
+    publish_wait_target(ctl, NULL, NULL);
+    free(SMimage);
+free_telemetry:
+    free_command_telemetry(&tel);
+free_saturation:
+    free_saturation_stats(&sat, serial, nbAct);
+free_buffers:
+    free_command_buffers(&cmdbuf);
+free_calib:
+    free_calibration_set(calib);
+free_modal:
+    if (modal != NULL)
+    {
+        free_modal_product(modal);
+    }
+release_dm:
+    // Safe DM shutdown, on interrupt or on failure
+    printf("ALPAO %s: resetting and releasing DM.\n", serial);
+    asdkReset(dm);
+    ret = asdkRelease(dm);
+    dm = NULL;
+
+    return result == -1 ? -1 : ret;
+}
+
+void * run_controller(void * arg)
+{
+    dmController * ctl = (dmController *) arg;
+
+    ctl->ret = controlLoop(ctl);
+    __atomic_store_n(&ctl->done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/*
+Argument parsing
+*/
+
+/* Program documentation. */
+static char doc[] =
+  "runALPAO-- enter the ALPAO DM <serial> command loop and wait for cacao shared memory images to be posted at <shm_name>. "
+  "Several serial/shm_name pairs run several DMs from one process, each with its own loop thread.";
+
+/* A description of the arguments we accept. */
+static char args_doc[] = "serial shm_name [serial shm_name ...]";
+
+/* The options we understand. */
+static struct argp_option options[] = {
+  {"nobias",     'b', 0, 0,  "Disable automatically biasing the DM (enabled by default)" },
+  {"nonorm",     'n', 0, 0,  "Disable displacement normalization (enabled by default)" },
+  {"fractional", 'f', 0, 0,  "Give inputs in fractional stroke (-1 to +1) rather than microns" },
+  {"kernel",     'k', "NAME", 0, "Conversion kernel: auto (default), avx512, avx2, sse2 or scalar" },
+  {"satlog",     's', "SECONDS", 0, "Minimum interval between actuator saturation log messages (default 1)" },
+  {"rtprio",     'p', "PRIO", 0, "Run the loop SCHED_FIFO at this real-time priority" },
+  {"cpu",        'c', "CORES", 0, "Pin the loop to this CPU core; with several DMs, a comma-separated core per DM" },
+  {"mlock",      'm', 0, 0,  "Lock all memory to avoid page faults in the loop" },
+  {"wait",       'w', "MODE", 0, "Wait for frames with sem (default), spin or hybrid" },
+  {"spin",       'S', "USEC", 0, "Hybrid wait: spin this long before blocking (default 100)" },
+  {"coalesce",   'C', 0, 0,  "Send only the newest frame when several have queued up" },
+  {"channels",   'N', "N", 0, "Sum N virtual DM channels <shm_name>_00.. into shm_name (max 16)" },
+  {"telemetry",  'D', "DEPTH", 0, "Keep the last DEPTH commands sent in <shm_name>_cmd (default 100, 0 off)" },
+  {"record",     'O', "PREFIX", 0, "Record every frame to PREFIX_<serial>_NNNNNN.bin" },
+  {"record-ring", 'G', "RECORDS", 0, "Recorder: records buffered in memory (default 4096)" },
+  {"record-chunk", 'K', "RECORDS", 0, "Recorder: records per file (default 100000)" },
+  {"pipeline",   'P', 0, 0,  "Convert frames and send commands in separate threads" },
+  {"sender-cpu", 'Q', "CORES", 0, "Pipeline: pin the sender thread to this core (one per DM, comma-separated)" },
+  {"sync",       'Y', 0, 0,  "Several DMs: send each frame to all of them together" },
+  {"sync-timeout", 'T', "USEC", 0, "Sync: send anyway if the other DMs' frame is this late (default 1000)" },
+  {"sync-id",    'J', "SOURCE", 0, "Sync: frame IDs from write counts (count, default) or the producers' md.cnt2 (cnt2)" },
+  {"dtype",      'd', "TYPE", 0, "Input image element type: float, double or int16 (default: an existing image's, else float)" },
+  {"int16-scale", 'I', "UNITS", 0, "int16 inputs: microns (or fractional stroke) per count (default 1)" },
+  {"direct",     'Z', 0, 0,  "Send commands written in actuator order and fractional stroke (nbAct x 1 x 4 doubles) without copying them" },
+  {"vector",     'V', 0, 0,  "Read an nbAct x 1 vector in actuator order instead of an image the size of the actuator map" },
+  {"modal",      'M', 0, 0,  "Read nmodes x 1 modal coefficients and expand them with the matrix in <serial>_modes.fits" },
+  {"modal-threads", 'H', "N", 0, "Modal: split the matrix product over N threads, the loop's included (default 1)" },
+  {"modal-cpus", 'U', "CORES", 0, "Modal: pin the N-1 helper threads to these cores (comma-separated, each DM's in turn); without them the helpers never spin" },
+  {"gather",     'g', "MODE", 0, "Gather actuator pixels by plan (block copies), index, or auto (default: the faster at startup)" },
+  {"reload",     'L', 0, 0,  "Reload the calibration files in ALPAO_CALIB when they change, without stopping the loop" },
+  {"resum",      'R', "FRAMES", 0, "Virtual DM: re-sum all channels every FRAMES updates (default 1000, 0 always)" },
+  { 0 }
+};
+
+/* Used by main to communicate with parse_opt. */
+struct arguments
+{
+  const char *args[2 * MAX_DMS]; /* serial and shared memory name pairs */
+  int nargs;
+  int nobias, nonorm, fractional;
+  const char *kernel;
+  double satlog;
+  int rtprio, mlock;
+  int cpus[MAX_DMS], ncpus;
+  int wait_mode;
+  double spin_us;
+  int coalesce;
+  int nchannels;
+  unsigned long resum_interval;
+  int sync;
+  double sync_timeout_us;
+  int sync_cnt2;
+  int pipeline;
+  int sender_cpus[MAX_DMS], nsender_cpus;
+  int telemetry_depth;
+  const char *record_prefix;
+  unsigned long record_ring, record_chunk;
+  int reload;
+  int dtype;
+  double input_scale;
+  int direct;
+  int vector;
+  int gather;
+  int modal, modal_threads;
+  int modal_cpus[MAX_DMS * (MAX_MODAL_THREADS - 1)], nmodal_cpus;
+};
+
+/* Parse a comma-separated list of cores, one per DM */
+static int parse_cores (struct argp_state *state, char *arg, int *cores, int max)
+{
+  char *tok;
+  int n = 0;
+
+  for (tok = strtok(arg, ","); tok != NULL; tok = strtok(NULL, ","))
+    {
+      if (n == max)
+        argp_error (state, "at most %d cores", max);
+      cores[n++] = atoi(tok);
+    }
+  return n;
+}
+
+/* Parse a single option. */
+static error_t parse_opt (int key, char *arg, struct argp_state *state)
+{
+  /* Get the input argument from argp_parse, which we
+     know is a pointer to our arguments structure. */
+  struct arguments *arguments = state->input;
+
+  switch (key)
+    {
+    case 'b':
+      arguments->nobias = 1;
+      break;
+    case 'n':
+      arguments->nonorm = 1;
+      break;
+    case 'f':
+      arguments->fractional = 1;
+      break;
+    case 'k':
+      arguments->kernel = arg;
+      break;
+    case 's':
+      arguments->satlog = strtod(arg, NULL);
+      break;
+    case 'p':
+      arguments->rtprio = atoi(arg);
+      break;
+    case 'c':
+      arguments->ncpus = parse_cores(state, arg, arguments->cpus, MAX_DMS);
+      break;
+    case 'P':
+      arguments->pipeline = 1;
+      break;
+    case 'O':
+      arguments->record_prefix = arg;
+      break;
+    case 'G':
+      arguments->record_ring = strtoul(arg, NULL, 10);
+      if (arguments->record_ring == 0)
+        argp_error (state, "the recorder ring needs at least one record");
+      break;
+    case 'K':
+      arguments->record_chunk = strtoul(arg, NULL, 10);
+      if (arguments->record_chunk == 0)
+        argp_error (state, "record chunks need at least one record");
+      break;
+    case 'D':
+      arguments->telemetry_depth = atoi(arg);
+      if (arguments->telemetry_depth < 0)
+        argp_error (state, "telemetry depth must be 0 or more");
+      break;
+    case 'Q':
+      arguments->nsender_cpus = parse_cores(state, arg, arguments->sender_cpus, MAX_DMS);
+      break;
+    case 'm':
+      arguments->mlock = 1;
+      break;
+    case 'w':
+      if (strcmp(arg, "sem") == 0)
+        arguments->wait_mode = WAIT_SEM;
+      else if (strcmp(arg, "spin") == 0)
+        arguments->wait_mode = WAIT_SPIN;
+      else if (strcmp(arg, "hybrid") == 0)
+        arguments->wait_mode = WAIT_HYBRID;
+      else
+        argp_error (state, "unknown wait mode %s", arg);
+      break;
+    case 'S':
+      arguments->spin_us = strtod(arg, NULL);
+      break;
+    case 'C':
+      arguments->coalesce = 1;
+      break;
+    case 'N':
+      arguments->nchannels = atoi(arg);
+      if (arguments->nchannels < 0 || arguments->nchannels > MAX_CHANNELS)
+        argp_error (state, "number of channels must be 0 to %d", MAX_CHANNELS);
+      break;
+    case 'Y':
+      arguments->sync = 1;
+      break;
+    case 'T':
+      arguments->sync_timeout_us = strtod(arg, NULL);
+      break;
+    case 'J':
+      if (strcmp(arg, "count") == 0)
+        arguments->sync_cnt2 = 0;
+      else if (strcmp(arg, "cnt2") == 0)
+        arguments->sync_cnt2 = 1;
+      else
+        argp_error (state, "unknown sync frame ID source '%s' (count or cnt2)", arg);
+      break;
+    case 'R':
+      arguments->resum_interval = strtoul(arg, NULL, 10);
+      break;
+    case 'L':
+      arguments->reload = 1;
+      break;
+    case 'd':
+      for (arguments->dtype = 0; arguments->dtype < N_INPUT_TYPES; arguments->dtype++)
+        if (strcmp(arg, input_types[arguments->dtype].name) == 0)
+          break;
+      if (arguments->dtype == N_INPUT_TYPES)
+        argp_error (state, "unknown input type %s", arg);
+      break;
+    case 'I':
+      arguments->input_scale = strtod(arg, NULL);
+      break;
+    case 'Z':
+      arguments->direct = 1;
+      break;
+    case 'V':
+      arguments->vector = 1;
+      break;
+    case 'M':
+      arguments->modal = 1;
+      break;
+    case 'U':
+      arguments->nmodal_cpus = parse_cores(state, arg, arguments->modal_cpus,
+                                           MAX_DMS * (MAX_MODAL_THREADS - 1));
+      break;
+    case 'H':
+      arguments->modal_threads = atoi(arg);
+      if (arguments->modal_threads < 1 || arguments->modal_threads > MAX_MODAL_THREADS)
+        argp_error (state, "modal threads must be 1 to %d", MAX_MODAL_THREADS);
+      break;
+    case 'g':
+      if (strcmp(arg, "auto") == 0)
+        arguments->gather = GATHER_AUTO;
+      else if (strcmp(arg, "plan") == 0)
+        arguments->gather = GATHER_PLAN;
+      else if (strcmp(arg, "index") == 0)
+        arguments->gather = GATHER_INDEX;
+      else
+        argp_error (state, "unknown gather mode %s", arg);
+      break;
+
+    case ARGP_KEY_ARG:
+      if (state->arg_num >= 2 * MAX_DMS)
+        /* Too many arguments. */
+        argp_error (state, "at most %d DMs", MAX_DMS);
+
+      arguments->args[state->arg_num] = arg;
+      arguments->nargs = state->arg_num + 1;
+
+      break;
+
+    case ARGP_KEY_END:
+      if (state->arg_num < 2 || state->arg_num % 2 != 0)
+        /* Not enough arguments, or a serial without its stream. */
+        argp_usage (state);
+      break;
+
+    default:
+      return ARGP_ERR_UNKNOWN;
+    }
+  return 0;
 }
 
 /* Our argp parser. */
 static struct argp argp = { options, parse_opt, args_doc, doc };
 
+/* Control plane: run one loop thread per DM and handle signals for all
+of them. The loops never see the signals; SIGINT (or any loop failing)
+sets stop and wakes each loop so it resets and releases its DM, and
+SIGUSR1 asks every loop to print its latency histograms. */
+int runControllers(dmController * ctls, int ndms, const loopOptions * opts)
+{
+    syncGroup group;
+    sigset_t signals;
+    siginfo_t info;
+    struct timespec poll = {0, 100000000};
+    int n, sig, ret = 0;
+
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGUSR1);
+    // blocked here so the loop threads inherit the mask
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    stop = 0;
+
+    if (opts->sync && ndms > 1)
+    {
+        init_sync_group(&group, ndms, opts->spin_us, opts->sync_timeout_us);
+        for ( n = 0 ; n < ndms ; n++ )
+        {
+            ctls[n].sync = &group;
+        }
+        printf("ALPAO sync: %d DMs send each frame together (timeout %.0f us, frame IDs from %s).\n",
+               ndms, opts->sync_timeout_us, opts->sync_cnt2 ? "cnt2" : "write counts");
+    }
+
+    for ( n = 0 ; n < ndms ; n++ )
+    {
+        pthread_mutex_init(&ctls[n].wake_lock, NULL);
+        if (pthread_create(&ctls[n].thread, NULL, run_controller, &ctls[n]) != 0)
+        {
+            printf("ALPAO %s: could not start the control loop thread\n", ctls[n].serial);
+            stop = 1;
+            ndms = n;
+            break;
+        }
+    }
+
+    while (!stop)
+    {
+        sig = sigtimedwait(&signals, &info, &poll);
+        if (sig == SIGINT)
+        {
+            printf("\nExiting the ALPAO control loop.\n");
+            stop = 1;
+        } else if (sig == SIGUSR1)
+        {
+            for ( n = 0 ; n < ndms ; n++ )
+            {
+                ctls[n].dump_latency = 1;
+            }
+        }
+        // a loop only returns on its own when it failed; bring the others down
+        for ( n = 0 ; n < ndms ; n++ )
+        {
+            if (__atomic_load_n(&ctls[n].done, __ATOMIC_ACQUIRE))
+            {
+                stop = 1;
+            }
+        }
+    }
+
+    for ( n = 0 ; n < ndms ; n++ )
+    {
+        while (!__atomic_load_n(&ctls[n].done, __ATOMIC_ACQUIRE))
+        {
+            wake_controller(&ctls[n]);
+            nanosleep(&poll, NULL);
+        }
+        pthread_join(ctls[n].thread, NULL);
+        pthread_mutex_destroy(&ctls[n].wake_lock);
+        if (ctls[n].ret == -1)
+        {
+            ret = -1;
+        }
+    }
+    if (opts->sync && ndms > 1)
+    {
+        print_sync_stats(&group);
+        pthread_mutex_destroy(&group.lock);
+    }
+    return ret;
+}
+
 /* Main program */
 int main( int argc, char ** argv )
 {
     struct arguments arguments;
-    const char * serial;
-    const char * shm_name;
+    loopOptions opts;
+    dmController ctls[MAX_DMS];
+    int ndms, n, m;
 
     /* Default values. */
+    arguments.nargs = 0;
     arguments.nobias = 0;
     arguments.nonorm = 0;
     arguments.fractional = 0;
+    arguments.kernel = NULL;
+    arguments.satlog = 1.0;
+    arguments.rtprio = 0;
+    arguments.ncpus = 0;
+    arguments.mlock = 0;
+    arguments.wait_mode = WAIT_SEM;
+    arguments.spin_us = 100;
+    arguments.coalesce = 0;
+    arguments.nchannels = 0;
+    arguments.resum_interval = 1000;
+    arguments.sync = 0;
+    arguments.sync_timeout_us = 1000;
+    arguments.sync_cnt2 = 0;
+    arguments.pipeline = 0;
+    arguments.telemetry_depth = 100;
+    arguments.record_prefix = NULL;
+    arguments.record_ring = 4096;
+    arguments.record_chunk = 100000;
+    arguments.nsender_cpus = 0;
+    arguments.reload = 0;
+    arguments.dtype = -1;
+    arguments.input_scale = 1.0;
+    arguments.direct = 0;
+    arguments.vector = 0;
+    arguments.gather = GATHER_AUTO;
+    arguments.modal = 0;
+    arguments.modal_threads = 1;
+    arguments.nmodal_cpus = 0;
 
     /* Parse our arguments; every option seen by parse_opt will
      be reflected in arguments. */
     argp_parse (&argp, argc, argv, 0, 0, &arguments);
 
-    serial = arguments.args[0];
-    shm_name = arguments.args[1];
+    opts.nobias = arguments.nobias;
+    opts.nonorm = arguments.nonorm;
+    opts.fractional = arguments.fractional;
+    opts.kernel = arguments.kernel;
+    opts.satlog = arguments.satlog;
+    opts.rtprio = arguments.rtprio;
+    opts.mlock = arguments.mlock;
+    opts.wait_mode = arguments.wait_mode;
+    opts.spin_us = arguments.spin_us;
+    opts.coalesce = arguments.coalesce;
+    opts.nchannels = arguments.nchannels;
+    opts.resum_interval = arguments.resum_interval;
+    opts.sync = arguments.sync;
+    opts.sync_timeout_us = arguments.sync_timeout_us;
+    opts.sync_cnt2 = arguments.sync_cnt2;
+    opts.pipeline = arguments.pipeline;
+    opts.telemetry_depth = arguments.telemetry_depth;
+    opts.record_prefix = arguments.record_prefix;
+    opts.record_ring = arguments.record_ring;
+    opts.record_chunk = arguments.record_chunk;
+    opts.reload = arguments.reload;
+    opts.dtype = arguments.dtype;
+    opts.input_scale = arguments.input_scale;
+    opts.direct = arguments.direct;
+    opts.vector = arguments.vector;
+    opts.gather = arguments.gather;
+    opts.modal = arguments.modal;
+    opts.modal_threads = arguments.modal_threads;
+    opts.modal_cpus = NULL;
+    if (opts.direct)
+    {
+        // the input already is the command: no normalization, bias or unit conversion
+        if (opts.nchannels > 0 || opts.reload || opts.pipeline ||
+            (opts.dtype != -1 && opts.dtype != INPUT_DOUBLE))
+        {
+            printf("--direct reads a double command ring; it can't be combined with --channels, --reload, --pipeline or --dtype\n");
+            return -1;
+        }
+        opts.nobias = 1;
+        opts.nonorm = 1;
+        opts.fractional = 1;
+    }
+    if (opts.modal && (opts.direct || opts.vector || opts.reload))
+    {
+        printf("--modal reads coefficients; it can't be combined with --direct, --vector or --reload\n");
+        return -1;
+    }
+    if (opts.nchannels > 0 && opts.dtype != -1 && opts.dtype != INPUT_FLOAT)
+    {
+        printf("Virtual DM channels are summed as float; --dtype=%s does not apply\n",
+               input_types[opts.dtype].name);
+        return -1;
+    }
+
+    // one controller per serial/shm_name pair, each on its own core if given
+    ndms = arguments.nargs / 2;
+    if (opts.sync && ndms < 2)
+    {
+        printf("--sync sends each frame to several DMs together; it needs at least two serial/shm_name pairs\n");
+        return -1;
+    }
+    if (arguments.nmodal_cpus > 0 &&
+        (!opts.modal || arguments.nmodal_cpus != ndms * (opts.modal_threads - 1)))
+    {
+        printf("--modal-cpus takes one core per modal helper, %d for %d DM(s) with --modal-threads=%d\n",
+               ndms * (opts.modal_threads - 1), ndms, opts.modal_threads);
+        return -1;
+    }
+    memset(ctls, 0, sizeof(ctls));
+    for ( n = 0 ; n < ndms ; n++ )
+    {
+        ctls[n].serial = arguments.args[2 * n];
+        ctls[n].shm_name = arguments.args[2 * n + 1];
+        ctls[n].opts = opts;
+        ctls[n].opts.cpu = n < arguments.ncpus ? arguments.cpus[n] : -1;
+        ctls[n].opts.sender_cpu = n < arguments.nsender_cpus ? arguments.sender_cpus[n] : -1;
+        if (arguments.nmodal_cpus > 0)
+        {
+            ctls[n].opts.modal_cpus = &arguments.modal_cpus[n * (arguments.modal_threads - 1)];
+        }
+        for ( m = 0 ; m < n ; m++ )
+        {
+            if (strcmp(ctls[m].shm_name, ctls[n].shm_name) == 0 ||
+                strcmp(ctls[m].serial, ctls[n].serial) == 0)
+            {
+                printf("ALPAO %s: each DM needs its own serial and shared memory image\n",
+                       ctls[n].serial);
+                return -1;
+            }
+        }
+    }
 
-    // enter the control loop
-    int ret = controlLoop(serial, shm_name, arguments.nobias, arguments.nonorm, arguments.fractional);
+    // enter the control loops
+    int ret = runControllers(ctls, ndms, &opts);
     asdkPrintLastError();
 
     return ret;